@@ -5,9 +5,20 @@
 
 namespace CGL {
 
-Application::Application(AppConfig config) { this->config = config; }
+Application::Application(AppConfig config)
+    : adaptive(config.adaptive), adaptive_substeps(0) {
+  this->config = config;
+}
 
-Application::~Application() {}
+Application::~Application() {
+  // the simulation thread steps the ropes until it is stopped
+  delete simulation;
+  glDeleteBuffers(1, &position_buffer);
+  glDeleteBuffers(1, &color_buffer);
+  glDeleteBuffers(1, &index_buffer);
+  for (Rope *rope : ropes)
+    delete rope;
+}
 
 void Application::init() {
   // Enable anti-aliasing and circular points.
@@ -27,48 +38,118 @@ void Application::init() {
                        config.ks, {0});
   ropeVerlet = new Rope(Vector2D(0, 200), Vector2D(-400, 200), 3, config.mass,
                         config.ks, {0});
+  ropeImplicit = new Rope(Vector2D(0, 200), Vector2D(-400, 200), 3, config.mass,
+                          config.ks, {0});
+  ropeXPBD = new Rope(Vector2D(0, 200), Vector2D(-400, 200), 3, config.mass,
+                      config.ks, {0});
+  ropes = {ropeEuler, ropeVerlet, ropeImplicit, ropeXPBD};
+
+  vector<const ParticleSystem *> systems;
+  for (Rope *rope : ropes)
+    systems.push_back(&rope->particles);
+  AppConfig c = config;
+  auto tick = [this, c](int steps_per_frame) {
+    if (adaptive) {
+      adaptive_substeps = ropeEuler->simulateAdaptive(&Rope::simulateEuler, 1, c.gravity) +
+                          ropeVerlet->simulateAdaptive(&Rope::simulateVerlet, 1, c.gravity);
+    } else {
+      double dt = 1.0 / steps_per_frame;
+      for (int i = 0; i < steps_per_frame; i++) {
+        ropeEuler->simulateEuler(dt, c.gravity);
+        ropeVerlet->simulateVerlet(dt, c.gravity);
+      }
+    }
+    // backward Euler stays stable with a single step per frame at any stiffness
+    ropeImplicit->simulateImplicitEuler(1, c.gravity);
+    // and so does XPBD, whose iteration count sets the cost instead of ks
+    ropeXPBD->simulateXPBD(1, c.gravity);
+  };
+  simulation = new Simulation(systems, tick, (int)config.steps_per_frame);
+  simulation->start();
+
+  create_buffers();
 }
 
-void Application::render() {
-  //Simulation loops
-  for (int i = 0; i < config.steps_per_frame; i++) {
-    ropeEuler->simulateEuler(1 / config.steps_per_frame, config.gravity);
-    ropeVerlet->simulateVerlet(1 / config.steps_per_frame, config.gravity);
+void Application::create_buffers() {
+  const unsigned char rope_colors[4][3] = {
+      {0, 0, 255}, {0, 255, 0}, {255, 0, 0}, {255, 255, 0}};
+
+  vector<unsigned char> colors;
+  vector<GLuint> indices;
+  for (int i = 0; i < (int)ropes.size(); i++) {
+    const ParticleSystem &ps = ropes[i]->particles;
+    GLuint offset = simulation->offset(i);
+    for (size_t j = 0; j < ps.num_particles(); j++)
+      colors.insert(colors.end(), rope_colors[i % 4], rope_colors[i % 4] + 3);
+    for (auto &e : ps.ends) {
+      indices.push_back(offset + e.a);
+      indices.push_back(offset + e.b);
+    }
   }
-  // Rendering ropes
-  Rope *rope;
+  num_particles = colors.size() / 3;
+  num_indices = indices.size();
+
+  glGenBuffers(1, &position_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+  glBufferData(GL_ARRAY_BUFFER, num_particles * 2 * sizeof(GLfloat), NULL,
+               GL_STREAM_DRAW);
+
+  glGenBuffers(1, &color_buffer);
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer);
+  glBufferData(GL_ARRAY_BUFFER, colors.size(), colors.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+  glGenBuffers(1, &index_buffer);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, num_indices * sizeof(GLuint),
+               indices.data(), GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
 
-  for (int i = 0; i < 2; i++) {
-    if (i == 0) {
-      glColor3f(0.0, 0.0, 1.0);
-      rope = ropeEuler;
-    } else {
-      glColor3f(0.0, 1.0, 0.0);
-      rope = ropeVerlet;
+// Writes this frame's positions into the position buffer. Respecifying the store
+// first orphans the one the GPU may still be drawing from, so mapping never waits
+// for the previous frame.
+void Application::stream_positions() {
+  const vector<Vector2D> &positions = simulation->positions();
+
+  glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+  GLsizeiptr size = num_particles * 2 * sizeof(GLfloat);
+  glBufferData(GL_ARRAY_BUFFER, size, NULL, GL_STREAM_DRAW);
+  GLfloat *mapped = (GLfloat *)glMapBufferRange(
+      GL_ARRAY_BUFFER, 0, size,
+      GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  if (mapped) {
+    for (GLsizei i = 0; i < num_particles; i++) {
+      mapped[2 * i] = positions[i].x;
+      mapped[2 * i + 1] = positions[i].y;
     }
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+  }
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-    glBegin(GL_POINTS);
-
-    for (auto &m : rope->masses) {
-      Vector2D p = m->position;
-      glVertex2d(p.x, p.y);
-    }
+void Application::render() {
+  // Positions the simulation thread published last, interpolated to now. The
+  // springs are fixed, so the index buffer built at init stays valid.
+  stream_positions();
 
-    glEnd();
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_COLOR_ARRAY);
 
-    glBegin(GL_LINES);
+  glBindBuffer(GL_ARRAY_BUFFER, position_buffer);
+  glVertexPointer(2, GL_FLOAT, 0, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, color_buffer);
+  glColorPointer(3, GL_UNSIGNED_BYTE, 0, 0);
 
-    for (auto &s : rope->springs) {
-      Vector2D p1 = s->m1->position;
-      Vector2D p2 = s->m2->position;
-      glVertex2d(p1.x, p1.y);
-      glVertex2d(p2.x, p2.y);
-    }
+  glDrawArrays(GL_POINTS, 0, num_particles);
 
-    glEnd();
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+  glDrawElements(GL_LINES, num_indices, GL_UNSIGNED_INT, 0);
 
-    glFlush();
-  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+  glBindBuffer(GL_ARRAY_BUFFER, 0);
+  glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
 }
 
 void Application::resize(size_t w, size_t h) {
@@ -89,9 +170,15 @@ void Application::keyboard_event(int key, int event, unsigned char mods) {
     if (config.steps_per_frame > 1) {
       config.steps_per_frame /= 2;
     }
+    simulation->set_steps_per_frame((int)config.steps_per_frame);
     break;
   case '=':
     config.steps_per_frame *= 2;
+    simulation->set_steps_per_frame((int)config.steps_per_frame);
+    break;
+  case 'A':
+    config.adaptive = !config.adaptive;
+    adaptive = config.adaptive;
     break;
   }
 }
@@ -100,7 +187,10 @@ string Application::name() { return "Rope Simulator"; }
 
 string Application::info() {
   ostringstream steps;
-  steps << "Steps per frame: " << config.steps_per_frame;
+  if (config.adaptive)
+    steps << "Adaptive, Euler and Verlet substeps per frame: " << adaptive_substeps;
+  else
+    steps << "Steps per frame: " << config.steps_per_frame;
 
   return steps.str();
 }
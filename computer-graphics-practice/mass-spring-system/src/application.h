@@ -14,6 +14,7 @@
 #include "CGL/renderer.h"
 
 #include "rope.h"
+#include "simulation.h"
 
 using namespace std;
 
@@ -28,12 +29,15 @@ struct AppConfig {
     // Environment variables
     gravity = Vector2D(0, -1);
     steps_per_frame = 64;
+    adaptive = false;
   }
 
   float mass;
   float ks;
 
   float steps_per_frame;
+  // Euler and Verlet substeps sized per step instead of steps_per_frame
+  bool adaptive;
   Vector2D gravity;
 };
 
@@ -50,6 +54,8 @@ public:
   std::string info();
 
   void keyboard_event(int key, int event, unsigned char mods);
+  // what the viewer calls on key presses, with GLFW key codes: '-', '=', 'A'
+  void key_event(char key) { keyboard_event(key, 0, 0); }
   // void cursor_event(float x, float y);
   // void scroll_event(float offset_x, float offset_y);
   // void mouse_event(int key, int event, unsigned char mods);
@@ -59,6 +65,27 @@ private:
 
   Rope *ropeEuler;
   Rope *ropeVerlet;
+  Rope *ropeImplicit;
+  Rope *ropeXPBD;
+  vector<Rope *> ropes;
+
+  // steps the ropes while render() draws them
+  Simulation *simulation;
+  // set by the keyboard, read by the simulation thread
+  atomic<bool> adaptive;
+  // Euler and Verlet substeps of the last adaptive frame, for info()
+  atomic<int> adaptive_substeps;
+
+  // Vertex buffers of all ropes together: positions streamed every frame, colors
+  // and the spring indices uploaded once, so each frame draws every mass and
+  // every spring with one call each.
+  void create_buffers();
+  void stream_positions();
+  GLuint position_buffer;
+  GLuint color_buffer;
+  GLuint index_buffer;
+  GLsizei num_particles;
+  GLsizei num_indices;
 
   size_t screen_width;
   size_t screen_height;
@@ -0,0 +1,277 @@
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include "mesh.h"
+#include "rope.h"
+#include "rope_batch.h"
+
+using namespace std;
+using namespace CGL;
+
+// Headless throughput benchmark of the rope integrators: builds a mass-spring
+// system, runs it for a number of steps and reports the rate and a checksum of
+// the final state, so runs with other integrators, thread counts or builds can
+// be compared on machines without a display.
+
+void usage(const char *binaryName) {
+  printf("Usage: %s [options]\n", binaryName);
+  printf("Program Options:\n");
+  printf("  -t  <rope|net|cloth|cloth3d>\n");
+  printf("                         Topology, a chain, a grid, a grid with shear springs, or a\n");
+  printf("                         3D cloth falling onto a ball, with self-collision (verlet)\n");
+  printf("  -t  strands            Ropes of 32 nodes hanging side by side, stepped as one batch\n");
+  printf("                         (euler or verlet)\n");
+  printf("  -n  <INT>              Number of nodes\n");
+  printf("  -i  <NAME>             Integrator: euler, verlet, implicit, xpbd or xpbd-jacobi\n");
+  printf("  -s  <INT>              Number of steps\n");
+  printf("  -d  <FLOAT>            Time step, or frame time with -a\n");
+  printf("  -a  <MODE>             Adaptive substeps, free or deterministic\n");
+  printf("  -k  <FLOAT>            Spring constant\n");
+  printf("  -m  <FLOAT>            Mass per node\n");
+  printf("\n");
+}
+
+// A grid of about n nodes hanging from its top row, 400 units wide. Cloth adds
+// both diagonals of every cell as shear springs.
+ParticleSystem buildNet(int n, float mass, float k, bool shear) {
+  int columns = max(2, (int)sqrt((double)n));
+  int rows = max(2, n / columns);
+  double spacing = 400.0 / (columns - 1);
+
+  ParticleSystem ps;
+  for (int r = 0; r < rows; r++)
+    for (int c = 0; c < columns; c++)
+      ps.add_particle(Vector2D(-200 + c * spacing, 200 - r * spacing), mass, r == 0);
+
+  for (int r = 0; r < rows; r++) {
+    for (int c = 0; c < columns; c++) {
+      int i = r * columns + c;
+      if (c + 1 < columns)
+        ps.add_spring(i, i + 1, k);
+      if (r + 1 < rows)
+        ps.add_spring(i, i + columns, k);
+      if (shear && c + 1 < columns && r + 1 < rows) {
+        ps.add_spring(i, i + columns + 1, k);
+        ps.add_spring(i + 1, i + columns, k);
+      }
+    }
+  }
+  return ps;
+}
+
+// FNV-1a over the bytes of the positions: equal only for bit-identical states
+template <typename Vector> uint64_t hashPositions(const vector<Vector> &positions) {
+  uint64_t hash = 14695981039346656037ull;
+  const unsigned char *bytes = (const unsigned char *)positions.data();
+  for (size_t i = 0; i < positions.size() * sizeof(Vector); i++)
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  return hash;
+}
+
+// A square cloth of about n nodes held level above a ball and a floor, falling
+// onto the ball with self-collision on.
+int benchCloth3D(int n, int steps, float delta_t, float k, float mass) {
+  int columns = max(3, (int)sqrt((double)n));
+  double spacing = 400.0 / (columns - 1);
+  Mesh cloth(Vector3D(-200, 150, -200), Vector3D(400, 0, 0), Vector3D(0, 0, 400),
+             columns, columns, mass, k, k, 0.2f * k, {});
+  cloth.spheres.push_back({Vector3D(0, 0, 0), 100, 0.3});
+  cloth.planes.push_back({Vector3D(0, -150, 0), Vector3D(0, 1, 0), 0.5});
+  cloth.self_collision = true;
+  cloth.thickness = 0.4 * spacing;
+
+  printf("cloth3d of %zu nodes and %zu springs, %d verlet steps of %g\n",
+         cloth.num_particles(), cloth.num_springs(), steps, delta_t);
+
+  Vector3D gravity(0, -1, 0);
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++)
+    cloth.simulateVerlet(delta_t, gravity);
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+
+  printf("%.3f s, %.1f steps/s, %.4g spring updates/s\n", seconds.count(),
+         steps / seconds.count(), (double)steps * cloth.num_springs() / seconds.count());
+
+  Vector3D position_sum;
+  for (size_t i = 0; i < cloth.num_particles(); i++)
+    position_sum += cloth.position[i];
+  printf("checksum: positions %.17g %.17g %.17g, hash %016llx\n", position_sum.x,
+         position_sum.y, position_sum.z, (unsigned long long)hashPositions(cloth.position));
+  return 0;
+}
+
+// About n nodes in ropes of 32, hanging from their top nodes along a 400 unit
+// line, simulated in one RopeBatch. Every other strand is lighter and damped more,
+// through its body parameters.
+int benchStrands(int n, int steps, const string &integrator, float delta_t, float k, float mass) {
+  const int strand_nodes = 32;
+  int strands = max(1, n / strand_nodes);
+  RopeBatch batch;
+  for (int s = 0; s < strands; s++) {
+    double x = strands > 1 ? -200 + 400.0 * s / (strands - 1) : 0;
+    BodyParameters parameters;
+    if (s % 2) {
+      parameters.gravity_scale = 0.5f;
+      parameters.euler_damping *= 4;
+      parameters.verlet_damping *= 4;
+    }
+    batch.add_rope(Vector2D(x, 200), Vector2D(x + 100, 200), strand_nodes, mass, k, {0},
+                   parameters);
+  }
+
+  void (RopeBatch::*step)(float, Vector2D) =
+      integrator == "euler" ? &RopeBatch::simulateEuler : &RopeBatch::simulateVerlet;
+
+  const ParticleSystem &ps = batch.particles;
+  printf("%zu strands of %zu nodes and %zu springs, %d %s steps of %g\n",
+         batch.num_bodies(), ps.num_particles(), ps.num_springs(), steps, integrator.c_str(),
+         delta_t);
+
+  Vector2D gravity(0, -1);
+  auto start = chrono::steady_clock::now();
+  for (int i = 0; i < steps; i++)
+    (batch.*step)(delta_t, gravity);
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+
+  printf("%.3f s, %.1f steps/s, %.4g spring updates/s\n", seconds.count(),
+         steps / seconds.count(), (double)steps * ps.num_springs() / seconds.count());
+
+  Vector2D position_sum, velocity_sum;
+  for (size_t i = 0; i < ps.num_particles(); i++) {
+    position_sum += ps.position[i];
+    velocity_sum += ps.velocity[i];
+  }
+  printf("checksum: positions %.17g %.17g, velocities %.17g %.17g, hash %016llx\n",
+         position_sum.x, position_sum.y, velocity_sum.x, velocity_sum.y,
+         (unsigned long long)hashPositions(ps.position));
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  string topology = "rope", integrator = "verlet", adaptive;
+  int nodes = 100000, steps = 1000;
+  float delta_t = 1 / 64.0f, ks = 100, mass = 1;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "t:n:i:s:d:k:m:a:")) != -1) {
+    switch (opt) {
+    case 't':
+      topology = optarg;
+      break;
+    case 'n':
+      nodes = atoi(optarg);
+      break;
+    case 'i':
+      integrator = optarg;
+      break;
+    case 's':
+      steps = atoi(optarg);
+      break;
+    case 'd':
+      delta_t = atof(optarg);
+      break;
+    case 'k':
+      ks = atof(optarg);
+      break;
+    case 'm':
+      mass = atof(optarg);
+      break;
+    case 'a':
+      adaptive = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (topology == "cloth3d") {
+    if (integrator != "verlet" || !adaptive.empty()) {
+      fprintf(stderr, "cloth3d runs fixed verlet steps only, -i %s%s is not supported\n",
+              integrator.c_str(), adaptive.empty() ? "" : " with -a");
+      return 1;
+    }
+    return benchCloth3D(nodes, steps, delta_t, ks, mass);
+  }
+  if (topology == "strands") {
+    if ((integrator != "euler" && integrator != "verlet") || !adaptive.empty()) {
+      fprintf(stderr, "strands runs fixed euler or verlet steps only, -i %s%s is not supported\n",
+              integrator.c_str(), adaptive.empty() ? "" : " with -a");
+      return 1;
+    }
+    return benchStrands(nodes, steps, integrator, delta_t, ks, mass);
+  }
+
+  Rope *rope;
+  if (topology == "rope") {
+    rope = new Rope(Vector2D(0, 200), Vector2D(-400, 200), nodes, mass, ks, {0});
+  } else if (topology == "net" || topology == "cloth") {
+    rope = new Rope(buildNet(nodes, mass, ks, topology == "cloth"));
+  } else {
+    usage(argv[0]);
+    return 1;
+  }
+
+  void (Rope::*step)(float, Vector2D);
+  if (integrator == "euler") {
+    step = &Rope::simulateEuler;
+  } else if (integrator == "verlet") {
+    step = &Rope::simulateVerlet;
+  } else if (integrator == "implicit") {
+    step = &Rope::simulateImplicitEuler;
+  } else if (integrator == "xpbd" || integrator == "xpbd-jacobi") {
+    step = &Rope::simulateXPBD;
+    if (integrator == "xpbd-jacobi")
+      rope->xpbd_iteration = ConstraintIteration::Jacobi;
+  } else {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!adaptive.empty() && adaptive != "free" && adaptive != "deterministic") {
+    usage(argv[0]);
+    return 1;
+  }
+  rope->deterministic_stepping = adaptive == "deterministic";
+
+  const ParticleSystem &ps = rope->particles;
+  printf("%s of %zu nodes and %zu springs, %d %s steps of %g\n", topology.c_str(),
+         ps.num_particles(), ps.num_springs(), steps, integrator.c_str(), delta_t);
+
+  Vector2D gravity(0, -1);
+  auto start = chrono::steady_clock::now();
+  long substeps = 0;
+  for (int i = 0; i < steps; i++) {
+    if (adaptive.empty())
+      (rope->*step)(delta_t, gravity);
+    else
+      substeps += rope->simulateAdaptive(step, delta_t, gravity);
+  }
+  chrono::duration<double> seconds = chrono::steady_clock::now() - start;
+  if (!adaptive.empty())
+    printf("%s adaptive substeps: %ld, %.1f per step\n", adaptive.c_str(), substeps,
+           (double)substeps / steps);
+  if (rope->cg_unconverged_steps > 0)
+    printf("%ld implicit steps skipped, their solve did not converge\n",
+           rope->cg_unconverged_steps);
+
+  printf("%.3f s, %.1f steps/s, %.4g spring updates/s\n", seconds.count(),
+         steps / seconds.count(), (double)steps * ps.num_springs() / seconds.count());
+
+  Vector2D position_sum, velocity_sum;
+  for (size_t i = 0; i < ps.num_particles(); i++) {
+    position_sum += ps.position[i];
+    velocity_sum += ps.velocity[i];
+  }
+  printf("checksum: positions %.17g %.17g, velocities %.17g %.17g, hash %016llx\n",
+         position_sum.x, position_sum.y, velocity_sum.x, velocity_sum.y,
+         (unsigned long long)hashPositions(ps.position));
+
+  delete rope;
+  return 0;
+}
@@ -0,0 +1,73 @@
+#include <cmath>
+#include <cstdio>
+
+#include "rope.h"
+
+using namespace std;
+using namespace CGL;
+
+// Consistency checks of the rope solvers, run by ctest. Every check prints a
+// line and the program exits with the number of failed checks.
+
+int failures = 0;
+
+void expect(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  failures += !ok;
+}
+
+// Stretch of the top spring of a soft rope hanging from its first node, after
+// it came to rest under XPBD.
+double restingStretch(ConstraintIteration iteration) {
+  Rope rope(Vector2D(0, 0), Vector2D(0, -90), 10, 1, 5, {0});
+  rope.xpbd_iteration = iteration;
+  for (int i = 0; i < 20000; i++)
+    rope.simulateXPBD(0.05f, Vector2D(0, -1));
+  const ParticleSystem &ps = rope.particles;
+  return (ps.position[1] - ps.position[0]).norm() - ps.rest_length[0];
+}
+
+// Kinetic, gravitational and spring energy of the rope.
+double energy(const Rope &rope, Vector2D gravity) {
+  const ParticleSystem &ps = rope.particles;
+  double e = 0;
+  for (size_t i = 0; i < ps.num_particles(); i++) {
+    double m = 1 / ps.inv_mass[i];
+    e += 0.5 * m * ps.velocity[i].norm2() - m * dot(gravity, ps.position[i]);
+  }
+  for (size_t s = 0; s < ps.num_springs(); s++) {
+    const SpringEnds &e_s = ps.ends[s];
+    double stretch = (ps.position[e_s.b] - ps.position[e_s.a]).norm() - ps.rest_length[s];
+    e += 0.5 * ps.stiffness[s] * stretch * stretch;
+  }
+  return e;
+}
+
+int main() {
+  // the top spring carries the other nine masses: stretch 9 m g / ks
+  double expected = 9 * 1.0 / 5;
+  double gauss_seidel = restingStretch(ConstraintIteration::GaussSeidel);
+  double jacobi = restingStretch(ConstraintIteration::Jacobi);
+  printf("resting stretch: Gauss-Seidel %.6f, Jacobi %.6f, static %.6f\n",
+         gauss_seidel, jacobi, expected);
+  expect(fabs(gauss_seidel - expected) < 1e-3 * expected,
+         "XPBD Gauss-Seidel settles at the static stretch of a soft rope");
+  expect(fabs(jacobi - gauss_seidel) < 1e-3 * expected,
+         "XPBD Jacobi settles at the same stretch as Gauss-Seidel");
+
+  // A long stiff rope at a step far past the explicit stability limit: backward
+  // Euler only dissipates, as long as every solve converges.
+  Rope rope(Vector2D(0, 200), Vector2D(-400, 200), 1000, 1, 1e4, {0});
+  Vector2D gravity(0, -1);
+  double start = energy(rope, gravity);
+  for (int i = 0; i < 200; i++)
+    rope.simulateImplicitEuler(1, gravity);
+  double end = energy(rope, gravity);
+  printf("stiff rope energy: %.6g -> %.6g, %ld unconverged steps\n", start, end,
+         rope.cg_unconverged_steps);
+  expect(end <= start, "Implicit Euler does not add energy to a long stiff rope");
+  expect(rope.cg_unconverged_steps == 0,
+         "Implicit Euler solves converge for a long stiff rope");
+
+  return failures;
+}
@@ -0,0 +1,162 @@
+#include <vector>
+
+#include "CGL/vector3D.h"
+
+#include "mesh.h"
+
+namespace CGL {
+
+    Mesh::Mesh(Vector3D corner, Vector3D width, Vector3D height, int num_width, int num_height,
+               float node_mass, float ks_structural, float ks_shear, float ks_bending,
+               vector<int> pinned_nodes)
+    {
+        if (num_width < 2 || num_height < 2)
+            return;
+        for (int r = 0; r < num_height; r++)
+            for (int c = 0; c < num_width; c++)
+                add_particle(corner + width * ((double)c / (num_width - 1)) +
+                             height * ((double)r / (num_height - 1)), node_mass, false);
+
+        for (int r = 0; r < num_height; r++)
+        {
+            for (int c = 0; c < num_width; c++)
+            {
+                int i = r * num_width + c;
+                if (c + 1 < num_width)
+                    add_spring(i, i + 1, ks_structural);
+                if (r + 1 < num_height)
+                    add_spring(i, i + num_width, ks_structural);
+                if (c + 1 < num_width && r + 1 < num_height)
+                {
+                    add_spring(i, i + num_width + 1, ks_shear);
+                    add_spring(i + 1, i + num_width, ks_shear);
+                }
+                if (c + 2 < num_width)
+                    add_spring(i, i + 2, ks_bending);
+                if (r + 2 < num_height)
+                    add_spring(i, i + 2 * num_width, ks_bending);
+            }
+        }
+        for (auto &i : pinned_nodes)
+            pin(i);
+    }
+
+    void Mesh::accumulateSpringForces()
+    {
+        if (colored_springs.size() != num_springs())
+            color_springs(ends, num_particles(), colored_springs, color_start);
+
+        for (size_t c = 0; c + 1 < color_start.size(); c++)
+        {
+            int first = color_start[c], last = color_start[c + 1];
+            #pragma omp parallel for schedule(static) if (last - first > parallel_threshold)
+            for (int k = first; k < last; k++)
+            {
+                int s = colored_springs[k];
+                const SpringEnds &e = ends[s];
+                Vector3D ab = position[e.b] - position[e.a];
+                double length = ab.norm();
+                Vector3D f = (stiffness[s] * (length - rest_length[s]) / length) * ab;
+                forces[e.a] += f;
+                forces[e.b] -= f;
+            }
+        }
+    }
+
+    void Mesh::simulateVerlet(float delta_t, Vector3D gravity)
+    {
+        accumulateSpringForces();
+
+        int n = (int)num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            if (!pinned[i])
+            {
+                Vector3D a = gravity + forces[i] * inv_mass[i];
+                Vector3D lastposition = position[i];
+                position[i] += (1 - damping) * (position[i] - last_position[i]) + a * delta_t * delta_t;
+                last_position[i] = lastposition;
+            }
+            forces[i] = Vector3D(0, 0, 0);
+        }
+
+        if (self_collision)
+            collideSelf();
+        collideObjects();
+    }
+
+    // Pushes overlapping particles apart. Each particle moves by half the average
+    // overlap with the particles it touches, all computed from the same positions
+    // and applied afterwards, so the result does not depend on the thread count.
+    void Mesh::collideSelf()
+    {
+        double diameter = 2 * thickness;
+        hash.build(position, diameter);
+
+        int n = (int)num_particles();
+        corrections.resize(n);
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            Vector3D correction(0, 0, 0);
+            int count = 0;
+            if (!pinned[i])
+            {
+                const Vector3D &p = position[i];
+                hash.for_each_near(p, [&](int j) {
+                    Vector3D d = p - position[j];
+                    double distance = d.norm();
+                    if (j != i && distance < diameter && distance > 0)
+                    {
+                        correction += d * ((diameter - distance) / distance);
+                        count++;
+                    }
+                });
+            }
+            corrections[i] = count ? correction * (0.5 / count) : correction;
+        }
+
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+            position[i] += corrections[i];
+    }
+
+    // Moves particles that entered a sphere to its surface, and particles that
+    // crossed a plane back to the side they came from. Either way the motion of
+    // the step is then scaled down by the friction of the object.
+    void Mesh::collideObjects()
+    {
+        // keeps corrected particles off the plane, so the next step sees which side they are on
+        const double surface_offset = 1e-4;
+
+        int n = (int)num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            if (pinned[i])
+                continue;
+            for (const Sphere &s : spheres)
+            {
+                Vector3D d = position[i] - s.center;
+                double distance = d.norm();
+                if (distance < s.radius && distance > 0)
+                {
+                    Vector3D tangent = s.center + d * (s.radius / distance);
+                    position[i] = last_position[i] + (1 - s.friction) * (tangent - last_position[i]);
+                }
+            }
+            for (const Plane &pl : planes)
+            {
+                double side = dot(position[i] - pl.point, pl.normal);
+                double last_side = dot(last_position[i] - pl.point, pl.normal);
+                if ((side < 0) != (last_side < 0))
+                {
+                    double offset = last_side < 0 ? -surface_offset : surface_offset;
+                    Vector3D tangent = position[i] - pl.normal * (side - offset);
+                    position[i] = last_position[i] + (1 - pl.friction) * (tangent - last_position[i]);
+                }
+            }
+        }
+    }
+}
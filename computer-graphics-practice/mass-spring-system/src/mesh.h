@@ -0,0 +1,104 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <vector>
+
+#include "CGL/vector3D.h"
+#include "particle_system.h"
+#include "spatial_hash.h"
+
+using namespace std;
+
+namespace CGL {
+
+// Solid ball the particles cannot enter.
+struct Sphere {
+  Vector3D center;
+  double radius;
+  double friction; // share of the tangential motion lost on contact, in [0, 1]
+};
+
+// Infinite plane the particles cannot cross, from either side.
+struct Plane {
+  Vector3D point;
+  Vector3D normal; // unit length
+  double friction;
+};
+
+// A mass-spring mesh in 3D, laid out like ParticleSystem: one array per particle
+// attribute and the springs as index pairs. Simulated with explicit Verlet,
+// followed by collisions against spheres, planes and, optionally, itself.
+class Mesh {
+public:
+  Mesh() {}
+  // A cloth of num_width x num_height particles spanning the parallelogram at
+  // corner with edges width and height. Structural springs join grid neighbours,
+  // shear springs the diagonals of every cell and bending springs particles two
+  // apart along the grid lines.
+  Mesh(Vector3D corner, Vector3D width, Vector3D height, int num_width,
+       int num_height, float node_mass, float ks_structural, float ks_shear,
+       float ks_bending, vector<int> pinned_nodes);
+
+  int add_particle(Vector3D p, float mass, bool is_pinned) {
+    position.push_back(p);
+    last_position.push_back(p);
+    forces.push_back(Vector3D(0, 0, 0));
+    inv_mass.push_back(1 / mass);
+    pinned.push_back(is_pinned);
+    return (int)position.size() - 1;
+  }
+
+  // a spring between particles a and b, at rest at their current distance
+  int add_spring(int a, int b, float k) {
+    SpringEnds e = {a, b};
+    ends.push_back(e);
+    rest_length.push_back((position[a] - position[b]).norm());
+    stiffness.push_back(k);
+    colored_springs.clear();
+    return (int)ends.size() - 1;
+  }
+
+  void pin(int i, bool is_pinned = true) { pinned[i] = is_pinned; }
+
+  size_t num_particles() const { return position.size(); }
+  size_t num_springs() const { return ends.size(); }
+
+  void simulateVerlet(float delta_t, Vector3D gravity);
+
+  // particles
+  vector<Vector3D> position;
+  vector<Vector3D> last_position;
+  vector<Vector3D> forces;
+  vector<float> inv_mass;
+  vector<unsigned char> pinned;
+
+  // springs
+  vector<SpringEnds> ends;
+  vector<double> rest_length;
+  vector<float> stiffness;
+
+  vector<Sphere> spheres;
+  vector<Plane> planes;
+
+  // Verlet damping, the share of the velocity lost per step
+  double damping = 0.00005;
+
+  // Particles are balls of radius thickness that push each other apart; the
+  // rest distance of neighbouring particles has to exceed twice the thickness
+  bool self_collision = false;
+  double thickness = 1;
+
+private:
+  void accumulateSpringForces();
+  void collideSelf();
+  void collideObjects();
+
+  vector<int> colored_springs;
+  vector<int> color_start;
+
+  // broad phase and per-step storage of collideSelf()
+  SpatialHash hash;
+  vector<Vector3D> corrections;
+}; // class Mesh
+}
+#endif /* MESH_H */
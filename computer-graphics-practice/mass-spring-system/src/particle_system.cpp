@@ -0,0 +1,69 @@
+#include <cstdint>
+#include <stdexcept>
+
+#include "particle_system.h"
+
+namespace CGL {
+
+    void color_springs(const vector<SpringEnds> &ends, size_t num_particles,
+                       vector<int> &colored, vector<int> &color_start)
+    {
+        size_t num_springs = ends.size();
+
+        // colors already taken by the springs at each particle, at most 64 of them;
+        // a chain needs two, a cloth with shear and bending springs about a dozen
+        vector<uint64_t> used(num_particles, 0);
+        vector<int> color(num_springs);
+        int num_colors = 0;
+        for (size_t s = 0; s < num_springs; s++)
+        {
+            uint64_t taken = used[ends[s].a] | used[ends[s].b];
+            if (taken == ~(uint64_t)0)
+                throw std::runtime_error("color_springs: more than 64 springs at a particle");
+            int c = 0;
+            while (taken & ((uint64_t)1 << c))
+                c++;
+            used[ends[s].a] |= (uint64_t)1 << c;
+            used[ends[s].b] |= (uint64_t)1 << c;
+            color[s] = c;
+            num_colors = max(num_colors, c + 1);
+        }
+
+        // counting sort of the springs by color, keeping their order inside a group
+        color_start.assign(num_colors + 1, 0);
+        for (size_t s = 0; s < num_springs; s++)
+            color_start[color[s] + 1]++;
+        for (int c = 0; c < num_colors; c++)
+            color_start[c + 1] += color_start[c];
+        colored.resize(num_springs);
+        vector<int> next(color_start.begin(), color_start.end() - 1);
+        for (size_t s = 0; s < num_springs; s++)
+            colored[next[color[s]]++] = (int)s;
+    }
+
+    void ParticleSystem::color_springs()
+    {
+        if (colored_springs.size() == num_springs())
+            return;
+        CGL::color_springs(ends, num_particles(), colored_springs, color_start);
+    }
+
+    void ParticleSystem::accumulate_spring_forces()
+    {
+        color_springs();
+        for (size_t c = 0; c + 1 < color_start.size(); c++)
+        {
+            int first = color_start[c], last = color_start[c + 1];
+            #pragma omp parallel for schedule(static) if (last - first > parallel_threshold)
+            for (int k = first; k < last; k++)
+            {
+                int s = colored_springs[k];
+                const SpringEnds &e = ends[s];
+                Vector2D ab = position[e.b] - position[e.a];
+                Vector2D f = stiffness[s] * (ab / ab.norm()) * (ab.norm() - rest_length[s]);
+                forces[e.a] += f;
+                forces[e.b] -= f;
+            }
+        }
+    }
+}
@@ -0,0 +1,142 @@
+#ifndef PARTICLE_SYSTEM_H
+#define PARTICLE_SYSTEM_H
+
+#include <vector>
+
+#include "CGL/vector2D.h"
+
+using namespace std;
+
+namespace CGL {
+
+// The two particles a spring connects, as indices into the particle arrays.
+struct SpringEnds {
+  int a, b;
+};
+
+// Groups springs so that no two springs of a group share a particle: the springs
+// of one group can add their forces in parallel without races. Greedy coloring;
+// group c is colored[color_start[c], color_start[c + 1]), springs keep their
+// order inside a group.
+void color_springs(const vector<SpringEnds> &ends, size_t num_particles,
+                   vector<int> &colored, vector<int> &color_start);
+
+// Step sizes of a time-corrected Verlet step of delta_t after one of last_delta_t
+// (0 before the first step): the last displacement is rescaled by delta_t /
+// last_delta_t and the acceleration weighted by delta_t times their average.
+struct VerletStep {
+  VerletStep(float delta_t, float last_delta_t)
+      : ratio(last_delta_t > 0 ? delta_t / last_delta_t : 1), delta_t(delta_t),
+        average_delta_t(last_delta_t > 0 ? 0.5 * (delta_t + last_delta_t) : delta_t) {}
+
+  double ratio;
+  double delta_t;
+  double average_delta_t;
+};
+
+// Particles and springs of a mass-spring system, one contiguous array per
+// attribute. A simulation pass over the particles streams through exactly the
+// arrays it reads, and springs reach their particles by index instead of through
+// pointers into separately allocated nodes.
+struct ParticleSystem {
+  int add_particle(Vector2D p, float mass, bool is_pinned) {
+    position.push_back(p);
+    last_position.push_back(p);
+    velocity.push_back(Vector2D(0, 0));
+    forces.push_back(Vector2D(0, 0));
+    inv_mass.push_back(1 / mass);
+    pinned.push_back(is_pinned);
+    return (int)position.size() - 1;
+  }
+
+  // a spring between particles a and b, at rest at their current distance
+  int add_spring(int a, int b, float k) {
+    SpringEnds e = {a, b};
+    ends.push_back(e);
+    rest_length.push_back((position[a] - position[b]).norm());
+    stiffness.push_back(k);
+    colored_springs.clear();
+    return (int)ends.size() - 1;
+  }
+
+  // Appends the particles and springs of other, its springs moved to the new
+  // particle indices. Returns the index of its first particle.
+  int append(const ParticleSystem &other) {
+    int first = (int)num_particles();
+    position.insert(position.end(), other.position.begin(), other.position.end());
+    last_position.insert(last_position.end(), other.last_position.begin(), other.last_position.end());
+    velocity.insert(velocity.end(), other.velocity.begin(), other.velocity.end());
+    forces.insert(forces.end(), other.forces.begin(), other.forces.end());
+    inv_mass.insert(inv_mass.end(), other.inv_mass.begin(), other.inv_mass.end());
+    pinned.insert(pinned.end(), other.pinned.begin(), other.pinned.end());
+    for (const SpringEnds &e : other.ends) {
+      SpringEnds moved = {first + e.a, first + e.b};
+      ends.push_back(moved);
+    }
+    rest_length.insert(rest_length.end(), other.rest_length.begin(), other.rest_length.end());
+    stiffness.insert(stiffness.end(), other.stiffness.begin(), other.stiffness.end());
+    colored_springs.clear();
+    return first;
+  }
+
+  // pinned particles keep their position
+  void pin(int i, bool is_pinned = true) { pinned[i] = is_pinned; }
+
+  size_t num_particles() const { return position.size(); }
+  size_t num_springs() const { return ends.size(); }
+
+  // colors the springs like the function above, again only after springs were added
+  void color_springs();
+
+  // Adds every spring's Hooke's law force to the forces of both of its ends, one
+  // color group after the other with the springs of a group in parallel.
+  void accumulate_spring_forces();
+
+  // Per-particle updates of the explicit integrators, after the spring forces
+  // were accumulated: particle i, unless pinned, is accelerated by gravity and its
+  // force, then its force is cleared.
+  // Semi-implicit Euler with the global damping force -damping * velocity.
+  void step_euler(int i, float delta_t, Vector2D gravity, float damping) {
+    if (!pinned[i]) {
+      forces[i] += -damping * velocity[i];
+      Vector2D a = gravity + forces[i] * inv_mass[i];
+      velocity[i] += a * delta_t;
+      position[i] += velocity[i] * delta_t;
+    }
+    forces[i] = Vector2D(0, 0);
+  }
+  // Time-corrected Verlet that drops the share `damping` of the velocity each step.
+  void step_verlet(int i, const VerletStep &step, Vector2D gravity, float damping) {
+    if (!pinned[i]) {
+      Vector2D a = gravity + forces[i] * inv_mass[i];
+      Vector2D lastposition = position[i];
+      position[i] = position[i] + (1 - damping) * step.ratio * (position[i] - last_position[i]) +
+                    a * step.delta_t * step.average_delta_t;
+      last_position[i] = lastposition;
+    }
+    forces[i] = Vector2D(0, 0);
+  }
+
+  // particles
+  vector<Vector2D> position;
+  vector<Vector2D> last_position; // explicit Verlet integration
+  vector<Vector2D> velocity;      // explicit Euler integration
+  vector<Vector2D> forces;
+  vector<float> inv_mass;
+  vector<unsigned char> pinned;
+
+  // springs
+  vector<SpringEnds> ends;
+  vector<double> rest_length;
+  vector<float> stiffness;
+
+  // spring indices by color: group c is colored_springs[color_start[c], color_start[c + 1])
+  vector<int> colored_springs;
+  vector<int> color_start;
+}; // struct ParticleSystem
+
+// Loops over fewer elements than this run on the calling thread, waking the OpenMP
+// team costs more than a small rope's whole step.
+const int parallel_threshold = 4096;
+}
+#endif /* PARTICLE_SYSTEM_H */
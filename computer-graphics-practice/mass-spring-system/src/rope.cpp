@@ -1,11 +1,12 @@
+#include <cmath>
+#include <cstdint>
 #include <iostream>
 #include <vector>
 
 #include "CGL/vector2D.h"
 
-#include "mass.h"
+#include "particle_system.h"
 #include "rope.h"
-#include "spring.h"
 
 namespace CGL {
 
@@ -14,106 +15,427 @@ namespace CGL {
         // TODO (Part 1): Create a rope starting at `start`, ending at `end`, and containing `num_nodes` nodes.
         if(num_nodes == 0 || num_nodes == 1)
             return;
-        Vector2D CurrentPosition = start;
-        //treat rope as a list
-        Mass * p = new Mass(start,node_mass,false);
-        masses.push_back(p);
-        Mass * l = nullptr;
-        Spring * presentSpring = nullptr;
+        particles.add_particle(start, node_mass, false);
         for(int i = 1;i <= num_nodes - 1;i++)
         {
-            std::cout << i;
-            if(i == (num_nodes -1))
+            Vector2D CurrentPosition = i == (num_nodes - 1) ? end : start + i * (end-start) / (num_nodes - 1);
+            //treat rope as a list: every node is tied to the one before it
+            int p = particles.add_particle(CurrentPosition, node_mass, false);
+            particles.add_spring(p - 1, p, k);
+        }
+        for (auto &i : pinned_nodes) {
+            particles.pin(i);
+        }
+    }
+
+    void Rope::simulateEuler(float delta_t, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        // TODO (Part 2): Use Hooke's law to calculate the force on a node
+        ps.accumulate_spring_forces();
+
+        // TODO (Part 2): Add global damping
+        float k_d_global = 0.01;
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+            ps.step_euler(i, delta_t, gravity, k_d_global);
+    }
+
+    void Rope::simulateVerlet(float delta_t, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        // TODO (Part 3): Simulate one timestep of the rope using explicit Verlet （solving constraints)
+        ps.accumulate_spring_forces();
+
+        // time-corrected Verlet, for steps that change size
+        VerletStep step(delta_t, last_delta_t);
+        // TODO (Part 4): Add global Verlet damping
+        float dampfactor = 0.00005;
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+            ps.step_verlet(i, step, gravity, dampfactor);
+        last_delta_t = delta_t;
+    }
+
+    // Gershgorin bound on the stiffness matrix scaled by the inverse masses: a spring
+    // adds at most 2 ks / m to the row of each free end.
+    double Rope::maxFrequency()
+    {
+        ParticleSystem &ps = particles;
+        vector<double> row(ps.num_particles(), 0);
+        for (size_t s = 0; s < ps.num_springs(); s++)
+        {
+            row[ps.ends[s].a] += 2 * ps.stiffness[s];
+            row[ps.ends[s].b] += 2 * ps.stiffness[s];
+        }
+        double omega2 = 0;
+        for (size_t i = 0; i < ps.num_particles(); i++)
+            if (!ps.pinned[i])
+                omega2 = max(omega2, row[i] * ps.inv_mass[i]);
+        return sqrt(omega2);
+    }
+
+    int Rope::simulateAdaptive(void (Rope::*step)(float, Vector2D), float frame_time, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        int n = (int)ps.num_particles();
+
+        double shortest = INFINITY;
+        for (size_t s = 0; s < ps.num_springs(); s++)
+            shortest = min(shortest, ps.rest_length[s]);
+
+        double upper = min((double)max_delta_t, (double)frame_time);
+        if (step == &Rope::simulateEuler || step == &Rope::simulateVerlet)
+        {
+            double omega = maxFrequency();
+            if (omega > 0)
+                upper = min(upper, stability_factor * 2 / omega);
+        }
+        double lower = min((double)min_delta_t, upper);
+        double dt = adaptive_delta_t > 0 ? adaptive_delta_t : upper;
+        dt = min(max(dt, lower), upper);
+
+        // the stretch rate of the last substep in units of max_stretch
+        auto stretch = [&]() {
+            double farthest = 0;
+            #pragma omp parallel for schedule(static) reduction(max : farthest) if (n > parallel_threshold)
+            for (int i = 0; i < n; i++)
+                farthest = max(farthest, (ps.position[i] - step_start[i]).norm());
+            return farthest / (shortest * max_stretch);
+        };
+
+        int substeps = 0;
+        if (deterministic_stepping)
+        {
+            // levels k of substeps frame_time / 2^k, and the time within the frame as
+            // an integer count of the finest substeps
+            int finest = 0, coarsest = 0, level = 0;
+            while (finest < 30 && frame_time / ((int64_t)1 << finest) > upper)
+                finest++;
+            coarsest = finest;
+            while (finest < 30 && frame_time / ((int64_t)1 << finest) > lower)
+                finest++;
+            while (level < finest && frame_time / ((int64_t)1 << level) > dt)
+                level++;
+            level = max(level, coarsest);
+
+            int64_t end = (int64_t)1 << finest, t = 0;
+            while (t < end)
             {
-                CurrentPosition = end;
+                step_start = ps.position;
+                (this->*step)(frame_time / ((int64_t)1 << level), gravity);
+                t += (int64_t)1 << (finest - level);
+                substeps++;
+
+                double e = stretch();
+                if (e > 1 && level < finest)
+                    level++;
+                else if (e < 0.25 && level > coarsest && t % ((int64_t)1 << (finest - level + 1)) == 0)
+                    level--;
             }
-            else
+            adaptive_delta_t = frame_time / ((int64_t)1 << level);
+        }
+        else
+        {
+            double t = 0;
+            while (t < frame_time)
             {
-                CurrentPosition = start + i * (end-start) / (num_nodes - 1);
+                // a last substep of a sliver of the frame is folded into this one
+                double h = frame_time - t < 1.01 * dt ? frame_time - t : dt;
+                step_start = ps.position;
+                (this->*step)(h, gravity);
+                t += h;
+                substeps++;
+
+                // the displacement grows about linearly with the step
+                double e = stretch();
+                double scale = e > 0 ? 0.9 / e : 2;
+                dt = min(max(dt * min(max(scale, 0.5), 2.0), lower), upper);
             }
-            l = p;
-            p = new Mass(CurrentPosition,node_mass,false);
-            presentSpring = new Spring(l,p,k);
-            masses.push_back(p);
-            springs.push_back(presentSpring);
+            adaptive_delta_t = dt;
         }
-//        Comment-in this part when you implement the constructor
-        for (auto &i : pinned_nodes) {
-            masses[i]->pinned = true;
+        return substeps;
+    }
+
+    // K x for the stiffness matrix K = d forces / d positions, without building K:
+    // every spring adds J (x_b - x_a) to particle a and subtracts it from b.
+    void Rope::applyStiffness(const vector<Vector2D> &x, vector<Vector2D> &out)
+    {
+        ParticleSystem &ps = particles;
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+            out[i] = Vector2D(0, 0);
+
+        for (size_t c = 0; c + 1 < ps.color_start.size(); c++)
+        {
+            int first = ps.color_start[c], last = ps.color_start[c + 1];
+            #pragma omp parallel for schedule(static) if (last - first > parallel_threshold)
+            for (int k = first; k < last; k++)
+            {
+                int s = ps.colored_springs[k];
+                const SpringEnds &e = ps.ends[s];
+                const SpringJacobian &J = jacobians[s];
+                Vector2D d = x[e.b] - x[e.a];
+                Vector2D f(J.xx * d.x + J.xy * d.y, J.xy * d.x + J.yy * d.y);
+                out[e.a] += f;
+                out[e.b] -= f;
+            }
         }
     }
 
-    void Rope::simulateEuler(float delta_t, Vector2D gravity)
+    // (M - h dF/dv - h^2 K) x, with the global damping force -damping * v
+    void Rope::applySystem(double h, double damping, const vector<Vector2D> &x, vector<Vector2D> &out)
+    {
+        ParticleSystem &ps = particles;
+        applyStiffness(x, out);
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            // pinned particles do not take part: their rows and columns are identity
+            if (ps.pinned[i])
+                out[i] = x[i];
+            else
+                out[i] = (1 / ps.inv_mass[i] + h * damping) * x[i] - h * h * out[i];
+        }
+    }
+
+    static double dotProduct(const vector<Vector2D> &a, const vector<Vector2D> &b)
+    {
+        int n = (int)a.size();
+        double sum = 0;
+        #pragma omp parallel for schedule(static) reduction(+ : sum) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+            sum += dot(a[i], b[i]);
+        return sum;
+    }
+
+    void Rope::simulateImplicitEuler(float delta_t, Vector2D gravity)
     {
-        for (auto &s : springs)
+        // Baraff and Witkin's linearized backward Euler step: the velocity change dv
+        // solves (M - h dF/dv - h^2 K) dv = h (F + h K v), after which x += h (v + dv).
+        ParticleSystem &ps = particles;
+        double h = delta_t;
+        float k_d_global = 0.01;
+        int n = (int)ps.num_particles();
+        for (auto *v : {&dv, &residual, &direction, &a_direction, &preconditioned, &diagonal})
+            v->resize(n);
+        jacobians.resize(ps.num_springs());
+
+        // Spring Jacobians at the current positions. The transverse part is dropped
+        // for compressed springs, which keeps K negative semi-definite and the system
+        // symmetric positive definite, as conjugate gradients need.
+        ps.color_springs();
+        int m = (int)ps.num_springs();
+        #pragma omp parallel for schedule(static) if (m > parallel_threshold)
+        for (int s = 0; s < m; s++)
         {
-            // TODO (Part 2): Use Hooke's law to calculate the force on a node
-            Vector2D ab = s->m2->position - s->m1->position;
-            Vector2D f =  s->k *  (ab / ab.norm()) * (ab.norm() - s->rest_length);
-            s->m1->forces += f;
-            s->m2->forces -= f;
+            Vector2D ab = ps.position[ps.ends[s].b] - ps.position[ps.ends[s].a];
+            double l = ab.norm();
+            Vector2D u = ab / l;
+            double k = ps.stiffness[s];
+            double transverse = max(0.0, 1 - ps.rest_length[s] / l);
+            jacobians[s].xx = k * (transverse * (1 - u.x * u.x) + u.x * u.x);
+            jacobians[s].xy = k * (1 - transverse) * u.x * u.y;
+            jacobians[s].yy = k * (transverse * (1 - u.y * u.y) + u.y * u.y);
         }
 
-        for (auto &m : masses)
+        // right hand side h (F + h K v) into residual, as dv starts at zero
+        ps.accumulate_spring_forces();
+        applyStiffness(ps.velocity, a_direction);
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            dv[i] = Vector2D(0, 0);
+            Vector2D f = ps.forces[i] + gravity / ps.inv_mass[i] - k_d_global * ps.velocity[i];
+            residual[i] = ps.pinned[i] ? Vector2D(0, 0) : h * (f + h * a_direction[i]);
+            ps.forces[i] = Vector2D(0, 0);
+            diagonal[i] = Vector2D(1, 1);
+        }
+
+        // Jacobi preconditioner: the inverse diagonal of the system matrix
+        for (int s = 0; s < m; s++)
+        {
+            const SpringEnds &e = ps.ends[s];
+            Vector2D d(jacobians[s].xx, jacobians[s].yy);
+            diagonal[e.a] += d;
+            diagonal[e.b] += d;
+        }
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
         {
-            if (!m->pinned)
+            if (ps.pinned[i])
+                diagonal[i] = Vector2D(1, 1);
+            else
             {
-                // TODO (Part 2): Add the force due to gravity, then compute the new velocity and position
-                m->forces += gravity * m->mass;
-                
+                double md = 1 / ps.inv_mass[i] + h * k_d_global;
+                // the Vector2D(1, 1) the sums started from is not part of K
+                diagonal[i] = Vector2D(1 / (md + h * h * (diagonal[i].x - 1)), 1 / (md + h * h * (diagonal[i].y - 1)));
+            }
+        }
 
-                // TODO (Part 2): Add global damping
-                if(true)
-                {
-                    float k_d_global = 0.01;
-                    m->forces += - k_d_global * m->velocity;
-                }
+        // preconditioned conjugate gradients
+        auto precondition = [&]() {
+            #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+            for (int i = 0; i < n; i++)
+                preconditioned[i] = Vector2D(diagonal[i].x * residual[i].x, diagonal[i].y * residual[i].y);
+        };
+        precondition();
+        direction = preconditioned;
+        double rz = dotProduct(residual, preconditioned);
+        double target = cg_tolerance * cg_tolerance * rz;
+        int iterations = cg_max_iterations > 0 ? cg_max_iterations : 4 * n;
+        for (int it = 0; it < iterations && rz > target && rz > 0; it++)
+        {
+            applySystem(h, k_d_global, direction, a_direction);
+            double alpha = rz / dotProduct(direction, a_direction);
+            #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+            for (int i = 0; i < n; i++)
+            {
+                dv[i] += alpha * direction[i];
+                residual[i] -= alpha * a_direction[i];
+            }
+            precondition();
+            double rz_next = dotProduct(residual, preconditioned);
+            double beta = rz_next / rz;
+            rz = rz_next;
+            #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+            for (int i = 0; i < n; i++)
+                direction[i] = preconditioned[i] + beta * direction[i];
+        }
+        if (!(rz <= target))
+        {
+            cg_unconverged_steps++;
+            return;
+        }
 
-                Vector2D a = m->forces / m->mass;
-                if(false)
-                {
-                    //Explicit method
-                    m->position += m->velocity * delta_t;
-                    m->velocity += a * delta_t;
-                }
-                else
-                {
-                    //semi-implicit method
-                    m->velocity += a * delta_t;
-                    m->position += m->velocity * delta_t;
-                }   
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            if (!ps.pinned[i])
+            {
+                ps.velocity[i] += dv[i];
+                ps.position[i] += h * ps.velocity[i];
             }
-            // Reset all forces on each mass
-            m->forces = Vector2D(0, 0);
         }
     }
 
-    void Rope::simulateVerlet(float delta_t, Vector2D gravity)
+    // One XPBD update of spring s with time scaled compliance alpha: returns the
+    // position corrections of both ends and the change of the spring's multiplier,
+    // which the caller adds to lambdas[s] scaled like the corrections it applies.
+    double Rope::projectDistanceConstraint(int s, double alpha, Vector2D &dx_a, Vector2D &dx_b)
     {
-        for (auto &s : springs)
+        ParticleSystem &ps = particles;
+        const SpringEnds &e = ps.ends[s];
+        double w_a = ps.pinned[e.a] ? 0 : ps.inv_mass[e.a];
+        double w_b = ps.pinned[e.b] ? 0 : ps.inv_mass[e.b];
+        Vector2D ab = ps.position[e.b] - ps.position[e.a];
+        double l = ab.norm();
+        if (w_a + w_b + alpha == 0 || l == 0)
         {
-            // TODO (Part 3): Simulate one timestep of the rope using explicit Verlet （solving constraints)
-            Vector2D ab = s->m2->position - s->m1->position;
-            Vector2D f = s->k *  (ab / ab.norm()) * (ab.norm() - s->rest_length);
-            s->m1->forces += f;
-            s->m2->forces -= f;
+            dx_a = dx_b = Vector2D(0, 0);
+            return 0;
         }
+        Vector2D n = ab / l;
+        double d_lambda = (-(l - ps.rest_length[s]) - alpha * lambdas[s]) / (w_a + w_b + alpha);
+        dx_a = -w_a * d_lambda * n;
+        dx_b = w_b * d_lambda * n;
+        return d_lambda;
+    }
 
-        for (auto &m : masses)
+    void Rope::simulateXPBD(float delta_t, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        double h = delta_t;
+        float k_d_global = 0.01;
+        int n = (int)ps.num_particles();
+        int m = (int)ps.num_springs();
+
+        // predict positions from the velocities
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            ps.last_position[i] = ps.position[i];
+            if (!ps.pinned[i])
+            {
+                ps.velocity[i] += h * (gravity - k_d_global * ps.inv_mass[i] * ps.velocity[i]);
+                ps.position[i] += h * ps.velocity[i];
+            }
+        }
+
+        ps.color_springs();
+        lambdas.assign(m, 0);
+        if (xpbd_iteration == ConstraintIteration::Jacobi)
         {
-            if (!m->pinned)
+            corrections.resize(2 * m);
+            constraint_count.assign(n, 0);
+            for (int s = 0; s < m; s++)
             {
-                m->forces += gravity * m->mass;
-                Vector2D a = m->forces / m->mass;
-
-                // TODO (Part 3.1): Set the new position of the rope mass
-                Vector2D lastposition = m->position;
-                // TODO (Part 4): Add global Verlet damping
-                float dampfactor = 0.00005;
-                m->position = m->position +  (1 - dampfactor) * (m->position - m->last_position) + a * delta_t *delta_t;
-                m->last_position = lastposition;
+                constraint_count[ps.ends[s].a]++;
+                constraint_count[ps.ends[s].b]++;
             }
-            m->forces =  Vector2D(0,0);
+        }
+
+        for (int it = 0; it < xpbd_iterations; it++)
+        {
+            if (xpbd_iteration == ConstraintIteration::GaussSeidel)
+            {
+                // constraints of a color share no particle, so each group runs in parallel
+                for (size_t c = 0; c + 1 < ps.color_start.size(); c++)
+                {
+                    int first = ps.color_start[c], last = ps.color_start[c + 1];
+                    #pragma omp parallel for schedule(static) if (last - first > parallel_threshold)
+                    for (int k = first; k < last; k++)
+                    {
+                        int s = ps.colored_springs[k];
+                        Vector2D dx_a, dx_b;
+                        lambdas[s] += projectDistanceConstraint(s, 1 / (ps.stiffness[s] * h * h), dx_a, dx_b);
+                        ps.position[ps.ends[s].a] += dx_a;
+                        ps.position[ps.ends[s].b] += dx_b;
+                    }
+                }
+            }
+            else
+            {
+                // Every constraint applies the same share of its correction to both
+                // ends and to its lambda, so the compliance term keeps matching how
+                // far the constraint actually moved the particles. The share is the
+                // relaxation over the larger constraint count of the two ends, which
+                // bounds the sum of the shares at any particle by the relaxation.
+                #pragma omp parallel for schedule(static) if (m > parallel_threshold)
+                for (int s = 0; s < m; s++)
+                {
+                    const SpringEnds &e = ps.ends[s];
+                    double share = jacobi_relaxation / max(constraint_count[e.a], constraint_count[e.b]);
+                    Vector2D dx_a, dx_b;
+                    lambdas[s] += share * projectDistanceConstraint(s, 1 / (ps.stiffness[s] * h * h), dx_a, dx_b);
+                    corrections[2 * s] = share * dx_a;
+                    corrections[2 * s + 1] = share * dx_b;
+                }
+                for (size_t c = 0; c + 1 < ps.color_start.size(); c++)
+                {
+                    int first = ps.color_start[c], last = ps.color_start[c + 1];
+                    #pragma omp parallel for schedule(static) if (last - first > parallel_threshold)
+                    for (int k = first; k < last; k++)
+                    {
+                        int s = ps.colored_springs[k];
+                        ps.position[ps.ends[s].a] += corrections[2 * s];
+                        ps.position[ps.ends[s].b] += corrections[2 * s + 1];
+                    }
+                }
+            }
+        }
+
+        // velocities from the corrected positions
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            if (!ps.pinned[i])
+                ps.velocity[i] = (ps.position[i] - ps.last_position[i]) / h;
         }
     }
-}
\ No newline at end of file
+}
+
@@ -1,26 +1,111 @@
 #ifndef ROPE_H
 #define ROPE_H
 
-#include "CGL/CGL.h"
-#include "mass.h"
-#include "spring.h"
+#include <utility>
+
+#include "CGL/vector2D.h"
+#include "particle_system.h"
 
 using namespace std;
 
 namespace CGL {
 
+// How simulateXPBD() sweeps the distance constraints.
+enum class ConstraintIteration {
+  // one color group at a time, each constraint seeing the corrections before it
+  GaussSeidel,
+  // all constraints from the same positions, each correction scaled down so the
+  // ones meeting at a particle do not overshoot
+  Jacobi
+};
+
 class Rope {
 public:
-  Rope(vector<Mass *> &masses, vector<Spring *> &springs)
-      : masses(masses), springs(springs) {}
+  // any mass-spring system, e.g. a net, simulated with the rope integrators
+  Rope(ParticleSystem particles) : particles(std::move(particles)) {}
   Rope(Vector2D start, Vector2D end, int num_nodes, float node_mass, float k,
        vector<int> pinned_nodes);
 
   void simulateVerlet(float delta_t, Vector2D gravity);
   void simulateEuler(float delta_t, Vector2D gravity);
+  // Backward Euler: stable for any stiffness and step size, at the price of a
+  // linear solve per step and numerical damping at large steps.
+  void simulateImplicitEuler(float delta_t, Vector2D gravity);
+  // Extended position based dynamics: the springs become distance constraints
+  // with compliance 1 / ks (0 for infinitely stiff ones), so the cost of a step
+  // does not depend on the stiffness. Pinned particles have zero inverse mass in
+  // the constraints.
+  void simulateXPBD(float delta_t, Vector2D gravity);
+
+  // Advances the rope by frame_time in substeps of step(delta_t, gravity), e.g.
+  // &Rope::simulateVerlet, sized by the stretch rate: the farthest any particle
+  // moved in the last substep, relative to the shortest spring. The substep grows
+  // while that stays well below max_stretch and shrinks when it exceeds it, within
+  // [min_delta_t, max_delta_t] and, for the explicit integrators, below the
+  // stability limit of the stiffest spring. Returns the number of substeps.
+  int simulateAdaptive(void (Rope::*step)(float, Vector2D), float frame_time,
+                       Vector2D gravity);
+
+  void pin(int node, bool pinned = true) { particles.pin(node, pinned); }
+
+  // the nodes of the rope and the springs between neighbours
+  ParticleSystem particles;
+
+  // conjugate gradient limits of simulateImplicitEuler(): relative residual and
+  // iteration count, 0 for four iterations per particle. A chain needs about as
+  // many iterations as it has nodes, so a fixed cap cuts long ropes short.
+  double cg_tolerance = 1e-6;
+  int cg_max_iterations = 0;
+  // Steps of simulateImplicitEuler() whose solve missed cg_tolerance. They leave
+  // the rope as it was: a partial velocity change adds energy.
+  long cg_unconverged_steps = 0;
+
+  // substep control of simulateAdaptive()
+  double max_stretch = 0.01;
+  float min_delta_t = 1e-4f;
+  float max_delta_t = 1;
+  // share of the explicit integrators' stability limit 2 / omega_max a substep may use
+  double stability_factor = 0.5;
+  // Substeps of frame_time / 2^k only, halved or doubled one level at a time and
+  // aligned to their own size: frames end exactly on a substep boundary and the
+  // sequence of substeps depends on nothing but the state of the rope.
+  bool deterministic_stepping = false;
+
+  // constraint solver settings of simulateXPBD()
+  int xpbd_iterations = 10;
+  ConstraintIteration xpbd_iteration = ConstraintIteration::GaussSeidel;
+  double jacobi_relaxation = 1.5;
+
+private:
+  // step size of the previous simulateVerlet() step, 0 before the first one
+  float last_delta_t = 0;
+  // substep simulateAdaptive() continues with in the next frame, 0 before the first
+  double adaptive_delta_t = 0;
+  vector<Vector2D> step_start;
+
+  // upper bound on the angular frequency of the fastest mode of the springs
+  double maxFrequency();
+
+  // Stiffness of one spring, d force(a) / d position(b): a symmetric 2x2 block.
+  struct SpringJacobian {
+    double xx, xy, yy;
+  };
+
+  // per-step storage of simulateImplicitEuler(), kept to skip reallocating it
+  vector<SpringJacobian> jacobians;
+  vector<Vector2D> dv, residual, direction, a_direction, preconditioned;
+  vector<Vector2D> diagonal;
+
+  // per-step storage of simulateXPBD()
+  vector<double> lambdas;
+  vector<Vector2D> corrections;
+  vector<int> constraint_count;
+
+  // the corrections of constraint s for compliance alpha, returns the change of its lambda
+  double projectDistanceConstraint(int s, double alpha, Vector2D &dx_a, Vector2D &dx_b);
 
-  vector<Mass *> masses;
-  vector<Spring *> springs;
+  void applyStiffness(const vector<Vector2D> &x, vector<Vector2D> &out);
+  void applySystem(double h, double damping, const vector<Vector2D> &x, vector<Vector2D> &out);
 }; // struct Rope
 }
 #endif /* ROPE_H */
@@ -0,0 +1,59 @@
+#include <vector>
+
+#include "CGL/vector2D.h"
+
+#include "particle_system.h"
+#include "rope.h"
+#include "rope_batch.h"
+
+namespace CGL {
+
+    int RopeBatch::add_rope(Vector2D start, Vector2D end, int num_nodes, float node_mass, float k,
+                            vector<int> pinned_nodes, BodyParameters parameters)
+    {
+        Rope rope(start, end, num_nodes, node_mass, k, pinned_nodes);
+        return add_body(rope.particles, parameters);
+    }
+
+    int RopeBatch::add_body(const ParticleSystem &system, BodyParameters parameters)
+    {
+        int b = (int)bodies.size();
+        particles.append(system);
+        body.resize(particles.num_particles(), b);
+        bodies.push_back(parameters);
+        body_start.push_back((int)particles.num_particles());
+        return b;
+    }
+
+    // The bodies share no particles, so the springs of all of them color into the
+    // groups of the most connected one: a batch of ropes still takes two passes.
+    void RopeBatch::simulateEuler(float delta_t, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        ps.accumulate_spring_forces();
+
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            const BodyParameters &p = bodies[body[i]];
+            ps.step_euler(i, delta_t, p.gravity_scale * gravity, p.euler_damping);
+        }
+    }
+
+    void RopeBatch::simulateVerlet(float delta_t, Vector2D gravity)
+    {
+        ParticleSystem &ps = particles;
+        ps.accumulate_spring_forces();
+
+        VerletStep step(delta_t, last_delta_t);
+        int n = (int)ps.num_particles();
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            const BodyParameters &p = bodies[body[i]];
+            ps.step_verlet(i, step, p.gravity_scale * gravity, p.verlet_damping);
+        }
+        last_delta_t = delta_t;
+    }
+}
@@ -0,0 +1,60 @@
+#ifndef ROPE_BATCH_H
+#define ROPE_BATCH_H
+
+#include <vector>
+
+#include "CGL/vector2D.h"
+#include "particle_system.h"
+
+using namespace std;
+
+namespace CGL {
+
+// Settings of one body of a RopeBatch, shared by all of its particles.
+struct BodyParameters {
+  BodyParameters() : gravity_scale(1), euler_damping(0.01f), verlet_damping(0.00005f) {}
+
+  float gravity_scale;
+  // global damping coefficient of simulateEuler()
+  float euler_damping;
+  // share of the velocity simulateVerlet() drops per step
+  float verlet_damping;
+};
+
+// Many independent ropes, or other bodies, packed into one particle system and
+// stepped together: every pass of a step is a single loop over all particles or
+// all springs of all bodies, so thousands of short ropes fill the threads and
+// vector lanes like one long one would. Particles find the parameters of their
+// body by index in the body table.
+class RopeBatch {
+public:
+  // Appends a rope like Rope's constructor builds, with pinned_nodes counted
+  // from its first node. Returns the index of the new body.
+  int add_rope(Vector2D start, Vector2D end, int num_nodes, float node_mass,
+               float k, vector<int> pinned_nodes,
+               BodyParameters parameters = BodyParameters());
+  // Appends any mass-spring system as one body, in whatever state it is in. A
+  // body already moving under Verlet continues as if its last step had been as
+  // long as the batch's last one.
+  int add_body(const ParticleSystem &system,
+               BodyParameters parameters = BodyParameters());
+
+  void simulateEuler(float delta_t, Vector2D gravity);
+  void simulateVerlet(float delta_t, Vector2D gravity);
+
+  size_t num_bodies() const { return bodies.size(); }
+
+  // the particles and springs of all bodies; body b owns the particles
+  // [body_start[b], body_start[b + 1])
+  ParticleSystem particles;
+  vector<BodyParameters> bodies;
+  vector<int> body_start = vector<int>(1, 0);
+  // body of every particle
+  vector<int> body;
+
+private:
+  // step size of the previous simulateVerlet() step, 0 before the first one
+  float last_delta_t = 0;
+}; // class RopeBatch
+}
+#endif /* ROPE_BATCH_H */
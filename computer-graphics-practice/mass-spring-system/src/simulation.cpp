@@ -0,0 +1,98 @@
+#include <algorithm>
+#include <cmath>
+
+#include "simulation.h"
+
+namespace CGL {
+
+constexpr double Simulation::ticks_per_second;
+constexpr unsigned Simulation::fresh;
+
+Simulation::Simulation(vector<const ParticleSystem *> systems,
+                       function<void(int)> tick, int steps_per_frame)
+    : systems(systems), tick(tick), steps_per_frame(steps_per_frame), ready(1),
+      running(false) {
+  size_t total = 0;
+  for (auto *ps : systems) {
+    offsets.push_back(total);
+    total += ps->num_particles();
+  }
+  for (auto &slot : slots) {
+    slot.time = 0;
+    slot.positions.reserve(total);
+    for (auto *ps : systems)
+      slot.positions.insert(slot.positions.end(), ps->position.begin(), ps->position.end());
+  }
+  interpolated = slots[current].positions;
+}
+
+Simulation::~Simulation() { stop(); }
+
+void Simulation::start() {
+  if (running)
+    return;
+  start_time = chrono::steady_clock::now();
+  time = 0;
+  running = true;
+  worker = thread(&Simulation::run, this);
+}
+
+void Simulation::stop() {
+  running = false;
+  if (worker.joinable())
+    worker.join();
+}
+
+// wall clock time since start() in ticks
+double Simulation::now() const {
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start_time;
+  return elapsed.count() * ticks_per_second;
+}
+
+void Simulation::run() {
+  // ticks behind the wall clock after which the simulation gives up catching up
+  // and skips ahead instead, when it is too slow for real time
+  const double max_lag = 4;
+
+  while (running) {
+    double target = now();
+    if (time + 1 > target) {
+      this_thread::sleep_for(chrono::duration<double>((time + 1 - target) / ticks_per_second));
+      continue;
+    }
+    if (target - time > max_lag)
+      time = floor(target) - 1;
+
+    tick(steps_per_frame);
+    time += 1;
+    publish();
+  }
+}
+
+void Simulation::publish() {
+  Snapshot &snapshot = slots[back];
+  snapshot.time = time;
+  snapshot.positions.clear();
+  for (auto *ps : systems)
+    snapshot.positions.insert(snapshot.positions.end(), ps->position.begin(), ps->position.end());
+  // release: the positions are written before the reader can see the slot
+  back = ready.exchange(back | fresh, memory_order_acq_rel) & ~fresh;
+}
+
+const vector<Vector2D> &Simulation::positions() {
+  if (ready.load(memory_order_relaxed) & fresh) {
+    unsigned taken = ready.exchange(previous, memory_order_acq_rel) & ~fresh;
+    previous = current;
+    current = taken;
+  }
+
+  // one tick behind the wall clock, between the last two snapshots
+  const Snapshot &a = slots[previous], &b = slots[current];
+  double alpha = 1;
+  if (b.time > a.time)
+    alpha = min(1.0, max(0.0, (now() - 1 - a.time) / (b.time - a.time)));
+  for (size_t i = 0; i < interpolated.size(); i++)
+    interpolated[i] = a.positions[i] + alpha * (b.positions[i] - a.positions[i]);
+  return interpolated;
+}
+}
@@ -0,0 +1,78 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "CGL/vector2D.h"
+#include "particle_system.h"
+
+using namespace std;
+
+namespace CGL {
+
+// Runs a simulation on a thread of its own so that neither the simulation nor the
+// renderer waits for the other. The simulation thread advances in fixed ticks of
+// one frame of simulated time, paced to ticks_per_second of wall clock time, and
+// publishes the particle positions after every tick. The render thread picks up
+// the newest positions whenever it draws and interpolates between the last two it
+// has seen, so motion stays smooth when the two run at different rates.
+//
+// The positions travel through four snapshot slots, each owned by exactly one of:
+// the writer's back slot, the ready slot, and the reader's previous and current
+// slots. Publishing swaps the back slot with the ready slot and reading swaps the
+// ready slot with the reader's previous one, each with a single atomic exchange,
+// so neither side ever blocks or copies more than one snapshot.
+class Simulation {
+public:
+  // tick(steps_per_frame) advances the systems by one frame
+  Simulation(vector<const ParticleSystem *> systems, function<void(int)> tick,
+             int steps_per_frame);
+  ~Simulation();
+
+  void start();
+  void stop();
+
+  void set_steps_per_frame(int steps) { steps_per_frame = steps; }
+
+  // Positions of all systems, back to back, interpolated to the current render
+  // time. Render thread only.
+  const vector<Vector2D> &positions();
+  // where the particles of system i start in positions()
+  size_t offset(int i) const { return offsets[i]; }
+
+  static constexpr double ticks_per_second = 60;
+
+private:
+  struct Snapshot {
+    double time;
+    vector<Vector2D> positions;
+  };
+
+  void run();
+  void publish();
+  double now() const;
+
+  vector<const ParticleSystem *> systems;
+  vector<size_t> offsets;
+  function<void(int)> tick;
+  atomic<int> steps_per_frame;
+
+  Snapshot slots[4];
+  // index of the ready slot, with fresh set while the reader has not taken it
+  static constexpr unsigned fresh = 4;
+  atomic<unsigned> ready;
+  unsigned back = 0;                  // simulation thread
+  unsigned previous = 2, current = 3; // render thread
+  vector<Vector2D> interpolated;
+
+  double time = 0; // simulated frames, simulation thread
+  chrono::steady_clock::time_point start_time;
+  atomic<bool> running;
+  thread worker;
+}; // class Simulation
+}
+#endif /* SIMULATION_H */
@@ -0,0 +1,63 @@
+#include <algorithm>
+
+#include "particle_system.h"
+#include "spatial_hash.h"
+
+namespace CGL {
+
+    void SpatialHash::build(const vector<Vector3D> &points, double cell_size)
+    {
+        this->cell_size = cell_size;
+        int n = (int)points.size();
+
+        // at least twice as many buckets as points keeps most buckets to one cell
+        uint32_t num_buckets = 1;
+        while (num_buckets < 2 * (uint32_t)max(n, 1))
+            num_buckets *= 2;
+        mask = num_buckets - 1;
+
+        cells.resize(n);
+        bucket_of.resize(n);
+        start.assign(num_buckets + 1, 0);
+
+        // count the points per bucket, shifted by one for the prefix sum
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            const Vector3D &p = points[i];
+            Cell c = {(int)floor(p.x / cell_size), (int)floor(p.y / cell_size),
+                      (int)floor(p.z / cell_size)};
+            uint32_t b = bucket(c.x, c.y, c.z);
+            cells[i] = c;
+            bucket_of[i] = b;
+            #pragma omp atomic
+            start[b + 1]++;
+        }
+
+        // a single pass, memory bound and cheaper than the counting around it
+        for (uint32_t b = 0; b < num_buckets; b++)
+            start[b + 1] += start[b];
+
+        // scatter, taking slots with atomic increments of a copy of the offsets
+        vector<int> next(start.begin(), start.end() - 1);
+        sorted.resize(n);
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int i = 0; i < n; i++)
+        {
+            int slot;
+            #pragma omp atomic capture
+            slot = next[bucket_of[i]]++;
+            sorted[slot] = i;
+        }
+
+        // the scatter order depends on the threads: restore index order per bucket,
+        // a handful of points each
+        int buckets = (int)num_buckets;
+        #pragma omp parallel for schedule(static) if (n > parallel_threshold)
+        for (int b = 0; b < buckets; b++)
+        {
+            if (start[b + 1] - start[b] > 1)
+                sort(sorted.begin() + start[b], sorted.begin() + start[b + 1]);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#ifndef SPATIAL_HASH_H
+#define SPATIAL_HASH_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+#include "CGL/vector3D.h"
+
+using namespace std;
+
+namespace CGL {
+
+// Uniform grid over space, hashed into a table of buckets, for finding the points
+// near a point without testing all of them. Rebuilt from scratch every step by a
+// counting sort of the point indices by bucket: the points of a bucket are
+// sorted[start[b], start[b + 1]), in increasing index order, so queries visit
+// neighbours in the same order whatever the thread count.
+class SpatialHash {
+public:
+  // buckets the points into cells of side cell_size
+  void build(const vector<Vector3D> &points, double cell_size);
+
+  // Calls f(j) for every point j in the 27 cells around p, p's own point
+  // included. With cell_size at least the query radius, this covers every point
+  // within that radius; the caller tests the actual distances.
+  template <typename F> void for_each_near(const Vector3D &p, F f) const {
+    int cx = (int)floor(p.x / cell_size), cy = (int)floor(p.y / cell_size),
+        cz = (int)floor(p.z / cell_size);
+    for (int z = cz - 1; z <= cz + 1; z++)
+      for (int y = cy - 1; y <= cy + 1; y++)
+        for (int x = cx - 1; x <= cx + 1; x++) {
+          uint32_t b = bucket(x, y, z);
+          // a bucket can hold other cells too, whose points belong to another query
+          for (int k = start[b]; k < start[b + 1]; k++) {
+            const Cell &c = cells[sorted[k]];
+            if (c.x == x && c.y == y && c.z == z)
+              f(sorted[k]);
+          }
+        }
+  }
+
+private:
+  uint32_t bucket(int x, int y, int z) const {
+    return ((uint32_t)x * 73856093u ^ (uint32_t)y * 19349663u ^
+            (uint32_t)z * 83492791u) & mask;
+  }
+
+  struct Cell {
+    int x, y, z;
+  };
+
+  double cell_size = 1;
+  uint32_t mask = 0; // number of buckets - 1, a power of two
+
+  vector<Cell> cells;         // per point
+  vector<uint32_t> bucket_of; // per point
+  vector<int> start;          // per bucket, and one past the last
+  vector<int> sorted;         // point indices by bucket
+}; // class SpatialHash
+}
+#endif /* SPATIAL_HASH_H */
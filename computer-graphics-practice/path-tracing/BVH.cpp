@@ -1,6 +1,8 @@
 #include <algorithm>
 #include <cassert>
+#include <limits>
 #include "BVH.hpp"
+#include "Stats.hpp"
 
 BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
                    SplitMethod splitMethod)
@@ -14,6 +16,8 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
 
     root = recursiveBuild(primitives);
 
+    if (!reportBuildTime)
+        return;
     time(&stop);
     double diff = difftime(stop, start);
     int hrs = (int)diff / 3600;
@@ -25,6 +29,75 @@ BVHAccel::BVHAccel(std::vector<Object*> p, int maxPrimsInNode,
         hrs, mins, secs);
 }
 
+static void deleteNodes(BVHBuildNode* node)
+{
+    if (!node)
+        return;
+    deleteNodes(node->left);
+    deleteNodes(node->right);
+    delete node;
+}
+
+// the primitives are owned by the caller, only the tree is freed here
+BVHAccel::~BVHAccel() { deleteNodes(root); }
+
+// Surface area heuristic: the centroids are binned into buckets along dim and the
+// objects are split at the bucket boundary that minimizes the expected cost of
+// traversing both children, their object counts weighted by their surface areas.
+// The extent of the centroids along dim has to be positive, so the first and the
+// last bucket are both occupied and neither side of the split is empty.
+std::vector<Object*>::iterator
+BVHAccel::partitionSAH(std::vector<Object*>& objects,
+                       const Bounds3& centroidBounds, int dim) const
+{
+    constexpr int nBuckets = 12;
+    struct Bucket {
+        int count = 0;
+        Bounds3 bounds;
+    };
+    Bucket buckets[nBuckets];
+
+    auto bucketOf = [&](Object* object) {
+        const Vector3f offset =
+            centroidBounds.Offset(object->getBounds().Centroid());
+        int b = nBuckets * offset[dim];
+        return std::min(b, nBuckets - 1);
+    };
+    for (auto* object : objects) {
+        Bucket& b = buckets[bucketOf(object)];
+        b.count++;
+        b.bounds = Union(b.bounds, object->getBounds());
+    }
+
+    // cost of splitting after bucket i, up to the constant traversal cost and
+    // the division by the node's own surface area
+    int minBucket = 0;
+    double minCost = std::numeric_limits<double>::infinity();
+    for (int i = 0; i < nBuckets - 1; ++i) {
+        Bounds3 b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j) {
+            b0 = Union(b0, buckets[j].bounds);
+            count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nBuckets; ++j) {
+            b1 = Union(b1, buckets[j].bounds);
+            count1 += buckets[j].count;
+        }
+        if (count0 == 0 || count1 == 0)
+            continue;
+        double cost = count0 * b0.SurfaceArea() + count1 * b1.SurfaceArea();
+        if (cost < minCost) {
+            minCost = cost;
+            minBucket = i;
+        }
+    }
+
+    return std::partition(objects.begin(), objects.end(), [&](Object* object) {
+        return bucketOf(object) <= minBucket;
+    });
+}
+
 BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
 {
     BVHBuildNode* node = new BVHBuildNode();
@@ -56,31 +129,38 @@ BVHBuildNode* BVHAccel::recursiveBuild(std::vector<Object*> objects)
             centroidBounds =
                 Union(centroidBounds, objects[i]->getBounds().Centroid());
         int dim = centroidBounds.maxExtent();
-        switch (dim) {
-        case 0:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().x <
-                       f2->getBounds().Centroid().x;
-            });
-            break;
-        case 1:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().y <
-                       f2->getBounds().Centroid().y;
-            });
-            break;
-        case 2:
-            std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
-                return f1->getBounds().Centroid().z <
-                       f2->getBounds().Centroid().z;
-            });
-            break;
-        }
-
         auto beginning = objects.begin();
         auto middling = objects.begin() + (objects.size() / 2);
         auto ending = objects.end();
 
+        const Vector3f& lo = centroidBounds.pMin;
+        const Vector3f& hi = centroidBounds.pMax;
+        if (splitMethod == SplitMethod::SAH && hi[dim] > lo[dim]) {
+            middling = partitionSAH(objects, centroidBounds, dim);
+        }
+        else {
+            switch (dim) {
+            case 0:
+                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+                    return f1->getBounds().Centroid().x <
+                           f2->getBounds().Centroid().x;
+                });
+                break;
+            case 1:
+                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+                    return f1->getBounds().Centroid().y <
+                           f2->getBounds().Centroid().y;
+                });
+                break;
+            case 2:
+                std::sort(objects.begin(), objects.end(), [](auto f1, auto f2) {
+                    return f1->getBounds().Centroid().z <
+                           f2->getBounds().Centroid().z;
+                });
+                break;
+            }
+        }
+
         auto leftshapes = std::vector<Object*>(beginning, middling);
         auto rightshapes = std::vector<Object*>(middling, ending);
 
@@ -111,9 +191,11 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
 
     std::array<int, 3> dirIsNeg = {ray.direction.x < 0, ray.direction.y < 0,
                                    ray.direction.z < 0};
+    STAT_INC(bvhBoxTests);
     if (!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg)){
         return isect;
     }
+    STAT_INC(bvhNodesVisited);
     // if it is not a leaf node, the object is null
     if(node->object){
         return node->object->getIntersection(ray);
@@ -124,6 +206,30 @@ Intersection BVHAccel::getIntersection(BVHBuildNode* node, const Ray& ray) const
     return left.distance < right.distance ? left : right;
 }
 
+bool BVHAccel::IntersectP(const Ray& ray) const
+{
+    if (!root)
+        return false;
+    return getIntersectionP(root, ray);
+}
+
+// any-hit traversal for shadow rays: stops at the first hit closer than
+// ray.t_max instead of looking for the closest one
+bool BVHAccel::getIntersectionP(BVHBuildNode* node, const Ray& ray) const
+{
+    std::array<int, 3> dirIsNeg = {ray.direction.x < 0, ray.direction.y < 0,
+                                   ray.direction.z < 0};
+    STAT_INC(bvhBoxTests);
+    if (!node->bounds.IntersectP(ray, ray.direction_inv, dirIsNeg))
+        return false;
+    STAT_INC(bvhNodesVisited);
+    if (node->object) {
+        Intersection isect = node->object->getIntersection(ray);
+        return isect.happened && isect.distance < ray.t_max;
+    }
+    return getIntersectionP(node->left, ray) ||
+           getIntersectionP(node->right, ray);
+}
 
 void BVHAccel::getSample(BVHBuildNode* node, float p, Intersection &pos, float &pdf){
     if(node->left == nullptr || node->right == nullptr){
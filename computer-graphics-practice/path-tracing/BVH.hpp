@@ -31,14 +31,24 @@ public:
     BVHAccel(std::vector<Object*> p, int maxPrimsInNode = 1, SplitMethod splitMethod = SplitMethod::NAIVE);
     Bounds3 WorldBound() const;
     ~BVHAccel();
+    // owns its node tree, so copies would free it twice
+    BVHAccel(const BVHAccel&) = delete;
+    BVHAccel& operator=(const BVHAccel&) = delete;
 
     Intersection Intersect(const Ray &ray) const;
     Intersection getIntersection(BVHBuildNode* node, const Ray& ray)const;
     bool IntersectP(const Ray &ray) const;
-    BVHBuildNode* root;
+    bool getIntersectionP(BVHBuildNode* node, const Ray& ray) const;
+    BVHBuildNode* root = nullptr;
+
+    // print the build time from the constructor (off in the benchmarks)
+    static inline bool reportBuildTime = true;
 
     // BVHAccel Private Methods
     BVHBuildNode* recursiveBuild(std::vector<Object*>objects);
+    std::vector<Object*>::iterator partitionSAH(std::vector<Object*>& objects,
+                                                const Bounds3& centroidBounds,
+                                                int dim) const;
 
     // BVHAccel Private Data
     const int maxPrimsInNode;
@@ -5,6 +5,7 @@
 #include <fstream>
 #include "Scene.hpp"
 #include "Renderer.hpp"
+#include "Stats.hpp"
 #include "omp.h"
 
 
@@ -23,6 +24,7 @@ void Renderer::Render(const Scene& scene)
     float imageAspectRatio = scene.width / (float)scene.height;
     Vector3f eye_pos(278, 273, -800);
     int m = 0;
+    RenderStats::reset();
 
     bool multithread = true;
 
@@ -43,6 +45,8 @@ void Renderer::Render(const Scene& scene)
             Vector3f dir = normalize(Vector3f(-x, y, 1));
             thread_local Vector3f color = Vector3f(0.0);
             for (int k = 0; k < spp; k++){
+                STAT_INC(primaryRays);
+                STAT_INC(samples);
                 framebuffer[m] += scene.castRay(Ray(eye_pos, dir), 0) / spp;  
             }
             m++;
@@ -70,6 +74,8 @@ void Renderer::Render(const Scene& scene)
             thread_local Vector3f color;
             color = Vector3f(0);
             for (int k = 0; k < spp; k++){
+                STAT_INC(primaryRays);
+                STAT_INC(samples);
                 color += scene.castRay(Ray(eye_pos, dir), 0) / spp;  
             }
             framebuffer[j*scene.width + i]+= color;
@@ -3,6 +3,7 @@
 //
 
 #include "Scene.hpp"
+#include "Stats.hpp"
 
 
 void Scene::buildBVH() {
@@ -66,6 +67,7 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     if (hit.emit.norm() > 0)
         hitColor = Vector3f(1);
     if (!hit.happened) return hitColor;
+    STAT_INC(pathVertices);
     // Implement Path Tracing Algorithm here
     Vector3f wo = normalize(-ray.direction);
     Vector3f p = hit.coords;
@@ -86,6 +88,7 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
     
     // check if the light is not blocked
     // => the distance = intersect(xx-p).distance
+    STAT_INC(shadowRays);
     if ((intersect(Ray(p, wi)).coords - xx).norm() < 0.01){
         L_dir = interLight.emit * hit.m->eval(wo, wi, N) * dotProduct(wi, N) * dotProduct(-wi, NN) 
                 / std::pow((xx - p).norm(),2) / pdf_light;
@@ -105,10 +108,14 @@ Vector3f Scene::castRay(const Ray &ray, int depth) const
         Vector3f wi = hit.m->sample(wo, N);
         float pdf_hemi = hit.m->pdf(wi, wo, N);
         if (pdf_hemi > 0.f){
+            STAT_INC(indirectRays);
             L_indir = castRay(Ray(p, wi), depth) * hit.m->eval(wi, wo, N) * dotProduct(wi, N)
                         / pdf_hemi / RussianRoulette;
         }
     }
+    else {
+        STAT_INC(rrTerminations);
+    }
     // std::cout << "L_dir: " << L_dir << " L_indir: " << L_indir << std::endl;
     return L_dir + L_indir;
 }
\ No newline at end of file
@@ -0,0 +1,124 @@
+//
+// Render statistics and hot-path counters.
+//
+// Every thread bumps its own RenderStats instance (no atomics, no sharing),
+// and RenderStats::collect() sums them up after the frame. Build with
+// -DRAYTRACING_STATS=ON to enable; otherwise the STAT_* macros expand to
+// nothing and the counters cost nothing.
+//
+
+#ifndef RAYTRACING_STATS_H
+#define RAYTRACING_STATS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#ifdef RAYTRACING_STATS
+#define STAT_INC(counter) (++RenderStats::local().counter)
+#define STAT_ADD(counter, n) (RenderStats::local().counter += (n))
+#else
+#define STAT_INC(counter) ((void)0)
+#define STAT_ADD(counter, n) ((void)0)
+#endif
+
+struct RenderStats
+{
+    uint64_t primaryRays = 0;
+    uint64_t shadowRays = 0;
+    uint64_t indirectRays = 0;
+    uint64_t bvhNodesVisited = 0; // nodes whose bounds the ray actually hit
+    uint64_t bvhBoxTests = 0;
+    uint64_t triangleTests = 0;
+    uint64_t triangleHits = 0;
+    uint64_t pathVertices = 0;    // surface hits along all paths
+    uint64_t rrTerminations = 0;
+    uint64_t samples = 0;         // one per camera path
+
+    RenderStats& operator+=(const RenderStats& o)
+    {
+        primaryRays += o.primaryRays;
+        shadowRays += o.shadowRays;
+        indirectRays += o.indirectRays;
+        bvhNodesVisited += o.bvhNodesVisited;
+        bvhBoxTests += o.bvhBoxTests;
+        triangleTests += o.triangleTests;
+        triangleHits += o.triangleHits;
+        pathVertices += o.pathVertices;
+        rrTerminations += o.rrTerminations;
+        samples += o.samples;
+        return *this;
+    }
+
+    // The calling thread's counters. Instances are owned by the registry and
+    // live until exit, so collect() never touches a dead thread's storage.
+    static RenderStats& local()
+    {
+        thread_local RenderStats* stats = registerThread();
+        return *stats;
+    }
+
+    // Sum of all threads' counters. Call once the worker threads are idle.
+    static RenderStats collect()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        RenderStats total;
+        for (auto& s : registry())
+            total += *s;
+        return total;
+    }
+
+    static void reset()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        for (auto& s : registry())
+            *s = RenderStats();
+    }
+
+    void report(double seconds) const
+    {
+        uint64_t rays = primaryRays + shadowRays + indirectRays;
+        auto per = [](uint64_t a, uint64_t b) { return b ? (double)a / b : 0.0; };
+        auto rate = [seconds](uint64_t a) { return seconds > 0 ? a / seconds : 0.0; };
+
+        printf("Render statistics:\n");
+        printf("  rays            : %llu (primary %llu, shadow %llu, indirect %llu)\n",
+               (unsigned long long)rays, (unsigned long long)primaryRays,
+               (unsigned long long)shadowRays, (unsigned long long)indirectRays);
+        printf("  rays/sec        : %.0f\n", rate(rays));
+        printf("  samples/sec     : %.0f\n", rate(samples));
+        printf("  BVH box tests   : %llu (%.2f per ray)\n",
+               (unsigned long long)bvhBoxTests, per(bvhBoxTests, rays));
+        printf("  BVH nodes hit   : %llu (%.2f per ray)\n",
+               (unsigned long long)bvhNodesVisited, per(bvhNodesVisited, rays));
+        printf("  triangle tests  : %llu (%.2f per ray), hits %llu\n",
+               (unsigned long long)triangleTests, per(triangleTests, rays),
+               (unsigned long long)triangleHits);
+        printf("  avg path length : %.2f\n", per(pathVertices, samples));
+        printf("  RR terminations : %llu\n", (unsigned long long)rrTerminations);
+    }
+
+private:
+    static std::vector<std::unique_ptr<RenderStats>>& registry()
+    {
+        static std::vector<std::unique_ptr<RenderStats>> r;
+        return r;
+    }
+
+    static std::mutex& registryMutex()
+    {
+        static std::mutex m;
+        return m;
+    }
+
+    static RenderStats* registerThread()
+    {
+        std::lock_guard<std::mutex> lock(registryMutex());
+        registry().push_back(std::make_unique<RenderStats>());
+        return registry().back().get();
+    }
+};
+
+#endif //RAYTRACING_STATS_H
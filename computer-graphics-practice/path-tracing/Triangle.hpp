@@ -5,6 +5,7 @@
 #include "Material.hpp"
 #include "OBJ_Loader.hpp"
 #include "Object.hpp"
+#include "Stats.hpp"
 #include "Triangle.hpp"
 #include <cassert>
 #include <array>
@@ -233,6 +234,7 @@ inline Intersection Triangle::getIntersection(Ray ray)
 {
     Intersection inter;
 
+    STAT_INC(triangleTests);
     if (dotProduct(ray.direction, normal) > 0)
         return inter;
     double u, v, t_tmp = 0;
@@ -264,6 +266,8 @@ inline Intersection Triangle::getIntersection(Ray ray)
     */
     //if(t_tmp < 0) return inter;
     inter.happened = t_tmp > 0 && u>0 && v>0 && (1-u-v>0);
+    if (inter.happened)
+        STAT_INC(triangleHits);
     inter.coords = ray(t_tmp);//
     inter.emit = m->getEmission();
     //Vector3f tt = t0,t1,t2;
@@ -0,0 +1,328 @@
+//
+// Microbenchmarks for the BVH and intersection kernels.
+//
+// Every benchmark runs on fixed, seeded inputs and is repeated until it has
+// run for at least --min-time seconds. Results go to a CSV file (one row per
+// benchmark) so runs can be diffed for regressions; a readable summary is
+// printed to stdout.
+//
+// usage: RayTracingBench [--models DIR] [--max-tris N] [--min-time S] [--out FILE]
+//
+// Soups go from 10^3 triangles up to --max-tris (default 10^5, at most 10^7).
+//
+
+#include "BVH.hpp"
+#include "Material.hpp"
+#include "Triangle.hpp"
+#include "Vector.hpp"
+#include "global.hpp"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+const float EPSILON = 0.00001;
+
+namespace {
+
+struct Options
+{
+    std::string models = "../models";
+    std::string out = "bench.csv";
+    size_t maxTris = 100000;
+    double minTime = 0.5;
+};
+
+struct Result
+{
+    std::string name, scene;
+    size_t primitives;
+    uint64_t ops;
+    double seconds;
+};
+
+// sink for benchmark outputs so the compiler cannot drop the work
+volatile double g_sink = 0;
+
+// Runs f() (which performs opsPerCall operations) until minTime has elapsed.
+Result run(const std::string& name, const std::string& scene, size_t primitives,
+           uint64_t opsPerCall, double minTime, const std::function<void()>& f)
+{
+    using clock = std::chrono::steady_clock;
+    f(); // warm up caches and the allocator
+
+    uint64_t calls = 0;
+    double elapsed = 0;
+    auto start = clock::now();
+    do {
+        f();
+        ++calls;
+        elapsed = std::chrono::duration<double>(clock::now() - start).count();
+    } while (elapsed < minTime);
+
+    Result r{name, scene, primitives, calls * opsPerCall, elapsed};
+    printf("%-28s %-14s %10zu prims %12.1f ns/op %10.3f Mops/s\n",
+           name.c_str(), scene.c_str(), primitives,
+           1e9 * r.seconds / r.ops, r.ops / r.seconds * 1e-6);
+    fflush(stdout);
+    return r;
+}
+
+// A flat list of triangles that the benchmarks own. Mesh scenes are
+// flattened so the BVH is built directly over their triangles.
+struct BenchScene
+{
+    std::string name;
+    std::vector<std::unique_ptr<MeshTriangle>> meshes;
+    std::vector<Triangle> soup;
+    std::vector<Object*> prims;
+    Bounds3 bounds;
+};
+
+bool fileExists(const std::string& path) { return std::ifstream(path).good(); }
+
+bool loadMeshScene(BenchScene& scene, const std::vector<std::string>& files)
+{
+    for (auto& f : files)
+        if (!fileExists(f)) {
+            printf("skipping %s: %s not found\n", scene.name.c_str(), f.c_str());
+            return false;
+        }
+    for (auto& f : files) {
+        scene.meshes.push_back(std::make_unique<MeshTriangle>(f));
+        for (auto& tri : scene.meshes.back()->triangles) {
+            scene.prims.push_back(&tri);
+            scene.bounds = Union(scene.bounds, tri.getBounds());
+        }
+    }
+    return true;
+}
+
+// n small random triangles scattered through the unit cube
+void makeSoup(BenchScene& scene, size_t n, Material* m)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> pos(0.f, 1.f), off(-0.02f, 0.02f);
+    scene.soup.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        Vector3f c(pos(rng), pos(rng), pos(rng));
+        scene.soup.emplace_back(c + Vector3f(off(rng), off(rng), off(rng)),
+                                c + Vector3f(off(rng), off(rng), off(rng)),
+                                c + Vector3f(off(rng), off(rng), off(rng)), m);
+    }
+    for (auto& tri : scene.soup) {
+        scene.prims.push_back(&tri);
+        scene.bounds = Union(scene.bounds, tri.getBounds());
+    }
+}
+
+Vector3f randomUnitVector(std::mt19937& rng)
+{
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    float z = 1.f - 2.f * u(rng);
+    float r = std::sqrt(std::max(0.f, 1.f - z * z));
+    float phi = 2 * M_PI * u(rng);
+    return Vector3f(r * std::cos(phi), r * std::sin(phi), z);
+}
+
+// Coherent pinhole camera rays looking down +z at the scene bounds.
+std::vector<Ray> cameraRays(const Bounds3& b, int res)
+{
+    Vector3f d = b.Diagonal();
+    Vector3f center = 0.5 * b.pMin + 0.5 * b.pMax;
+    Vector3f eye(center.x, center.y, b.pMin.z - 2 * std::max(d.x, d.y));
+    std::vector<Ray> rays;
+    rays.reserve(res * res);
+    for (int j = 0; j < res; ++j)
+        for (int i = 0; i < res; ++i) {
+            Vector3f target(b.pMin.x + d.x * (i + 0.5f) / res,
+                            b.pMin.y + d.y * (j + 0.5f) / res, center.z);
+            Ray r(eye, normalize(target - eye));
+            r.t_max = (target - eye).norm();
+            rays.push_back(r);
+        }
+    return rays;
+}
+
+// Incoherent rays leaving random surface points in random hemisphere
+// directions, the way diffuse bounces do.
+std::vector<Ray> diffuseRays(const BenchScene& scene, size_t n)
+{
+    std::mt19937 rng(5678);
+    std::uniform_int_distribution<size_t> pick(0, scene.prims.size() - 1);
+    std::uniform_real_distribution<float> u(0.f, 1.f);
+    float len = 0.5f * scene.bounds.Diagonal().norm();
+    std::vector<Ray> rays;
+    rays.reserve(n);
+    for (size_t k = 0; k < n; ++k) {
+        auto* tri = static_cast<Triangle*>(scene.prims[pick(rng)]);
+        float x = std::sqrt(u(rng)), y = u(rng);
+        Vector3f p = tri->v0 * (1.0f - x) + tri->v1 * (x * (1.0f - y)) +
+                     tri->v2 * (x * y);
+        Vector3f dir = randomUnitVector(rng);
+        if (dotProduct(dir, tri->normal) < 0)
+            dir = -dir;
+        Ray r(p + tri->normal * 1e-4f, dir);
+        r.t_max = len;
+        rays.push_back(r);
+    }
+    return rays;
+}
+
+void benchScene(BenchScene& scene, const Options& opt, std::vector<Result>& results)
+{
+    size_t n = scene.prims.size();
+
+    for (auto method : {BVHAccel::SplitMethod::NAIVE, BVHAccel::SplitMethod::SAH}) {
+        std::string name = method == BVHAccel::SplitMethod::NAIVE
+                               ? "bvh_build/NAIVE" : "bvh_build/SAH";
+        results.push_back(run(name, scene.name, n, n, opt.minTime, [&] {
+            BVHAccel bvh(scene.prims, 1, method);
+            g_sink = g_sink + bvh.root->bounds.pMax.x;
+        }));
+    }
+
+    BVHAccel bvh(scene.prims);
+    std::vector<Ray> camera = cameraRays(scene.bounds, 256);
+    std::vector<Ray> diffuse = diffuseRays(scene, 65536);
+
+    for (auto* set : {&camera, &diffuse}) {
+        std::string kind = set == &camera ? "camera" : "diffuse";
+        results.push_back(run("closest_hit/" + kind, scene.name, n, set->size(),
+                              opt.minTime, [&] {
+            double acc = 0;
+            for (auto& r : *set) {
+                Intersection isect = bvh.Intersect(r);
+                if (isect.happened)
+                    acc += isect.distance;
+            }
+            g_sink = g_sink + acc;
+        }));
+        results.push_back(run("shadow/" + kind, scene.name, n, set->size(),
+                              opt.minTime, [&] {
+            int hits = 0;
+            for (auto& r : *set)
+                hits += bvh.IntersectP(r);
+            g_sink = g_sink + hits;
+        }));
+    }
+}
+
+void benchKernels(const Options& opt, Material* m, std::vector<Result>& results)
+{
+    const size_t n = 4096;
+    BenchScene scene;
+    scene.name = "kernels";
+    makeSoup(scene, n, m);
+    std::vector<Ray> rays = diffuseRays(scene, n);
+
+    results.push_back(run("Triangle::getIntersection", scene.name, n, n,
+                          opt.minTime, [&] {
+        int hits = 0;
+        for (size_t i = 0; i < n; ++i)
+            hits += scene.soup[(i * 7) % n].getIntersection(rays[i]).happened;
+        g_sink = g_sink + hits;
+    }));
+
+    std::vector<Bounds3> boxes;
+    std::vector<std::array<int, 3>> dirIsNeg;
+    for (size_t i = 0; i < n; ++i) {
+        Bounds3 b = scene.soup[(i * 7) % n].getBounds();
+        // grow the boxes so roughly half the tests hit
+        boxes.emplace_back(b.pMin - Vector3f(0.2f), b.pMax + Vector3f(0.2f));
+        const Vector3f& d = rays[i].direction;
+        dirIsNeg.push_back({d.x < 0, d.y < 0, d.z < 0});
+    }
+    results.push_back(run("Bounds3::IntersectP", scene.name, n, n, opt.minTime, [&] {
+        int hits = 0;
+        for (size_t i = 0; i < n; ++i)
+            hits += boxes[i].IntersectP(rays[i], rays[i].direction_inv, dirIsNeg[i]);
+        g_sink = g_sink + hits;
+    }));
+
+    std::mt19937 rng(91011);
+    std::vector<Vector3f> normals, dirs;
+    for (size_t i = 0; i < n; ++i) {
+        normals.push_back(randomUnitVector(rng));
+        dirs.push_back(randomUnitVector(rng));
+    }
+    results.push_back(run("Material::sample", scene.name, n, n, opt.minTime, [&] {
+        double acc = 0;
+        for (size_t i = 0; i < n; ++i)
+            acc += m->sample(dirs[i], normals[i]).z;
+        g_sink = g_sink + acc;
+    }));
+    results.push_back(run("Material::eval", scene.name, n, n, opt.minTime, [&] {
+        double acc = 0;
+        for (size_t i = 0; i < n; ++i)
+            acc += m->eval(dirs[i], dirs[(i + 1) % n], normals[i]).x;
+        g_sink = g_sink + acc;
+    }));
+}
+
+void writeCsv(const std::string& path, const std::vector<Result>& results)
+{
+    std::ofstream out(path);
+    out << "benchmark,scene,primitives,ops,seconds,ns_per_op,ops_per_sec\n";
+    for (auto& r : results)
+        out << r.name << ',' << r.scene << ',' << r.primitives << ',' << r.ops
+            << ',' << r.seconds << ',' << 1e9 * r.seconds / r.ops << ','
+            << r.ops / r.seconds << '\n';
+    printf("\nwrote %zu results to %s\n", results.size(), path.c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    Options opt;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (!strcmp(argv[i], "--models"))
+            opt.models = argv[i + 1];
+        else if (!strcmp(argv[i], "--max-tris"))
+            opt.maxTris = std::stoull(argv[i + 1]);
+        else if (!strcmp(argv[i], "--min-time"))
+            opt.minTime = std::stod(argv[i + 1]);
+        else if (!strcmp(argv[i], "--out"))
+            opt.out = argv[i + 1];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    BVHAccel::reportBuildTime = false;
+    Material* white = new Material(DIFFUSE, Vector3f(0.0f));
+    white->Kd = Vector3f(0.725f, 0.71f, 0.68f);
+    std::vector<Result> results;
+
+    benchKernels(opt, white, results);
+
+    {
+        BenchScene cornell;
+        cornell.name = "cornellbox";
+        std::vector<std::string> files;
+        for (auto part : {"floor", "shortbox", "tallbox", "left", "right", "light"})
+            files.push_back(opt.models + "/cornellbox/" + part + ".obj");
+        if (loadMeshScene(cornell, files))
+            benchScene(cornell, opt, results);
+    }
+    {
+        BenchScene bunny;
+        bunny.name = "bunny";
+        if (loadMeshScene(bunny, {opt.models + "/bunny/bunny.obj"}))
+            benchScene(bunny, opt, results);
+    }
+    for (size_t n = 1000; n <= opt.maxTris && n <= 10000000; n *= 10) {
+        BenchScene soup;
+        soup.name = "soup_" + std::to_string(n);
+        makeSoup(soup, n, white);
+        benchScene(soup, opt, results);
+    }
+
+    writeCsv(opt.out, results);
+    return 0;
+}
@@ -4,6 +4,7 @@
 #include "Sphere.hpp"
 #include "Vector.hpp"
 #include "global.hpp"
+#include "Stats.hpp"
 #include <chrono>
 
 // In the main function of the program, we create the scene (create objects and
@@ -52,5 +53,9 @@ int main(int argc, char** argv)
     std::cout << "          : " << std::chrono::duration_cast<std::chrono::minutes>(stop - start).count() << " minutes\n";
     std::cout << "          : " << std::chrono::duration_cast<std::chrono::seconds>(stop - start).count() << " seconds\n";
 
+#ifdef RAYTRACING_STATS
+    RenderStats::collect().report(std::chrono::duration<double>(stop - start).count());
+#endif
+
     return 0;
 }
\ No newline at end of file
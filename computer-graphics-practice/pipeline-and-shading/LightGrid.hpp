@@ -0,0 +1,121 @@
+//
+// Screen tile light lists for tiled forward shading.
+//
+
+#ifndef RASTERIZER_LIGHTGRID_H
+#define RASTERIZER_LIGHTGRID_H
+#include <Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "Shader.hpp"
+
+// The screen split into tile_size x tile_size pixel tiles, each with the list of lights
+// whose sphere of influence may reach a pixel in it. The lists are rebuilt once per
+// frame from the view space lights, so a fragment only loops over the lights of its
+// tile instead of all of them. Lights with an infinite radius are in every list.
+class LightGrid
+{
+public:
+    // A tile's light list: indices into the lights the grid was built from.
+    struct range
+    {
+        const int* first;
+        const int* last;
+        const int* begin() const { return first; }
+        const int* end() const { return last; }
+    };
+
+    LightGrid(int w, int h, int tile_size = 16)
+        : width(w), height(h), tile_size(tile_size),
+          tiles_x((w + tile_size - 1) / tile_size), tiles_y((h + tile_size - 1) / tile_size) {}
+
+    int width, height;
+    // a multiple of 4 x 2, so a fragment_shader_batch never straddles two tiles
+    int tile_size;
+
+    // lights of the tile containing pixel (x, y), in the pixel coordinates of the rasterizer
+    range lights_at(int x, int y) const
+    {
+        int tile = std::clamp(y / tile_size, 0, tiles_y - 1) * tiles_x + std::clamp(x / tile_size, 0, tiles_x - 1);
+        return {indices.data() + offsets[tile], indices.data() + offsets[tile + 1]};
+    }
+
+    // Assigns every light to the tiles its bounding sphere covers on screen, with a
+    // symmetric perspective projection like get_projection_matrix() builds. The lists
+    // are stored back to back, two passes over the lights count and then fill them.
+    void build(const std::vector<light>& lights, const Eigen::Matrix4f& projection)
+    {
+        float z_near = projection(2, 3) / (projection(2, 2) - 1);
+        float z_far = projection(2, 3) / (projection(2, 2) + 1);
+
+        rects.resize(lights.size());
+        offsets.assign(tiles_x * tiles_y + 1, 0);
+        for (size_t k = 0; k < lights.size(); ++k)
+        {
+            rects[k] = tile_rect(lights[k], projection, z_near, z_far);
+            for (int ty = rects[k].y0; ty <= rects[k].y1; ++ty)
+                for (int tx = rects[k].x0; tx <= rects[k].x1; ++tx)
+                    ++offsets[ty * tiles_x + tx + 1];
+        }
+        for (int t = 0; t < tiles_x * tiles_y; ++t)
+            offsets[t + 1] += offsets[t];
+
+        indices.resize(offsets.back());
+        std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+        for (size_t k = 0; k < lights.size(); ++k)
+            for (int ty = rects[k].y0; ty <= rects[k].y1; ++ty)
+                for (int tx = rects[k].x0; tx <= rects[k].x1; ++tx)
+                    indices[fill[ty * tiles_x + tx]++] = k;
+    }
+
+private:
+    // inclusive tile range, empty when x0 > x1
+    struct rect
+    {
+        int x0, y0, x1, y1;
+    };
+
+    rect tile_rect(const light& l, const Eigen::Matrix4f& projection, float z_near, float z_far) const
+    {
+        rect all = {0, 0, tiles_x - 1, tiles_y - 1}, none = {0, 0, -1, -1};
+        if (!std::isfinite(l.radius))
+            return all;
+
+        const Eigen::Vector3f& c = l.position;
+        float r = l.radius, d = -c.z();
+        if (d + r < z_near || d - r > z_far)
+            return none;
+        if (d - r < z_near)
+            return all; // reaches past the near plane, bounding its projection is not worth it
+
+        // The sphere lies in front of the camera, so along each axis the slopes a/d of
+        // its points are bounded by the two tangents through the eye, at angles
+        // atan(c_a / d) -+ asin(r / |(c_a, d)|).
+        auto ndc_range = [&](float ca, float scale, float& lo, float& hi) {
+            float center = std::atan2(ca, d);
+            float half = std::asin(r / std::sqrt(ca * ca + d * d));
+            lo = scale * std::tan(center - half);
+            hi = scale * std::tan(center + half);
+        };
+        float x_lo, x_hi, y_lo, y_hi;
+        ndc_range(c.x(), projection(0, 0), x_lo, x_hi);
+        ndc_range(c.y(), projection(1, 1), y_lo, y_hi);
+        if (x_hi < -1 || x_lo > 1 || y_hi < -1 || y_lo > 1)
+            return none;
+
+        // the same viewport transformation as rst::rasterizer::to_screen
+        auto tile = [&](float ndc, int size, int tiles) {
+            int pixel = (int)std::floor(0.5f * size * (std::clamp(ndc, -1.0f, 1.0f) + 1.0f));
+            return std::clamp(pixel / tile_size, 0, tiles - 1);
+        };
+        return {tile(x_lo, width, tiles_x), tile(y_lo, height, tiles_y),
+                tile(x_hi, width, tiles_x), tile(y_hi, height, tiles_y)};
+    }
+
+    int tiles_x, tiles_y;
+    std::vector<rect> rects;
+    std::vector<int> offsets; // list of tile t is indices[offsets[t], offsets[t + 1])
+    std::vector<int> indices;
+};
+#endif //RASTERIZER_LIGHTGRID_H
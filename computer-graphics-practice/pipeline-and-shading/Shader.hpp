@@ -5,7 +5,10 @@
 #ifndef RASTERIZER_SHADER_H
 #define RASTERIZER_SHADER_H
 #include <Eigen/Eigen>
+#include <limits>
+#include <vector>
 #include "Texture.hpp"
+#include "ShadowMap.hpp"
 
     
 struct fragment_shader_payload
@@ -24,6 +27,48 @@ struct fragment_shader_payload
     Eigen::Vector3f normal;
     Eigen::Vector2f tex_coords;
     Texture* texture;
+    int x = 0, y = 0; // pixel position
+};
+
+// Eight fragments shaded together, stored as structure of arrays: every column of
+// the attribute arrays holds one component for all lanes, so shaders written with
+// Eigen array expressions run on all eight at once. The lanes are a 4x2 pixel block,
+//     lane = (y % 2) * 4 + x % 4,
+// i.e. two 2x2 quads side by side. Lanes outside the triangle or failing the depth
+// test are still interpolated (they are needed for derivatives) but are masked off
+// and never written; shaders should only sample textures for active lanes.
+struct fragment_shader_batch
+{
+    static constexpr int size = 8;
+    using lanes = Eigen::Array<float, size, 1>;
+    using lanes3 = Eigen::Array<float, size, 3>;
+    using lanes2 = Eigen::Array<float, size, 2>;
+
+    lanes3 view_pos;
+    lanes3 color;
+    lanes3 normal;
+    lanes2 tex_coords;
+    Eigen::Array<bool, size, 1> active;
+    Texture* texture = nullptr;
+    int x = 0, y = 0; // pixel position of lane 0
+
+    // Screen space derivatives: the difference to the horizontal (vertical) neighbour
+    // inside each 2x2 quad, shared by both pixels of the pair.
+    static lanes ddx(const lanes& v)
+    {
+        lanes d;
+        for (int i = 0; i < size; ++i)
+            d[i] = v[i | 1] - v[i & ~1];
+        return d;
+    }
+
+    static lanes ddy(const lanes& v)
+    {
+        lanes d;
+        for (int i = 0; i < size; ++i)
+            d[i] = v[i | 4] - v[i & ~4];
+        return d;
+    }
 };
 
 struct vertex_shader_payload
@@ -31,4 +76,37 @@ struct vertex_shader_payload
     Eigen::Vector3f position;
 };
 
+class LightGrid;
+
+struct light
+{
+    Eigen::Vector3f position;
+    Eigen::Vector3f intensity;
+    // Distance at which the light has faded out completely. Finite radii let the light
+    // grid skip the light wherever it cannot reach.
+    float radius = std::numeric_limits<float>::infinity();
+    // depth seen from the light, if it casts shadows
+    const ShadowMap* shadow = nullptr;
+};
+
+// Constants shared by every fragment of a draw, set up once instead of per fragment.
+struct shading_uniforms
+{
+    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
+    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
+    // added once, not per light
+    Eigen::Vector3f amb_light_intensity{20, 20, 20};
+    Eigen::Vector3f eye_pos{0, 0, 10};
+    float p = 150;
+
+    std::vector<light> lights = {light{{20, 20, 20}, {500, 500, 500}},
+                                 light{{-20, 20, 0}, {500, 500, 500}}};
+
+    // per tile lists of the lights, when set; shaders only loop over those
+    const LightGrid* light_grid = nullptr;
+
+    // height map scale of the bump and displacement shaders
+    float kh = 0.2, kn = 0.1;
+};
+
 #endif //RASTERIZER_SHADER_H
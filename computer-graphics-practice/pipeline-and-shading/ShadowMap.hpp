@@ -0,0 +1,67 @@
+//
+// Depth texture rendered from a light, for shadow tests in the fragment shaders.
+//
+
+#ifndef RASTERIZER_SHADOWMAP_H
+#define RASTERIZER_SHADOWMAP_H
+#include <Eigen/Eigen>
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+// The depth buffer of a depth-only draw from a light's point of view, together with
+// the transform that took shading space (the view space the fragment shaders light in)
+// to the light's clip space.
+class ShadowMap
+{
+public:
+    ShadowMap(int w, int h, const Eigen::Matrix4f& to_light_clip, std::vector<float> depth)
+        : width(w), height(h), to_light_clip(to_light_clip), depth(std::move(depth)) {}
+
+    int width, height;
+    Eigen::Matrix4f to_light_clip;
+    // depth offset against self shadowing, in the units of the depth buffer
+    float bias = 0.05f;
+
+    // Fraction of light reaching point, with 3x3 percentage closer filtering: the depth
+    // comparison is evaluated on the 4x4 texels around the point and the results are
+    // weighted as nine bilinear lookups would, so shadow edges fade over about two
+    // texels instead of stepping. Points outside the map are lit.
+    float visibility(const Eigen::Vector3f& point) const
+    {
+        Eigen::Vector4f clip = to_light_clip * Eigen::Vector4f(point.x(), point.y(), point.z(), 1.0f);
+        if (!(clip.w() > 0))
+            return 1.0f;
+
+        // the same viewport transformation as rst::rasterizer::to_screen
+        float f1 = (50 - 0.1) / 2.0;
+        float f2 = (50 + 0.1) / 2.0;
+        float x = 0.5f * width * (clip.x() / clip.w() + 1.0f);
+        float y = 0.5f * height * (clip.y() / clip.w() + 1.0f);
+        float z = clip.z() / clip.w() * f1 + f2 - bias;
+        if (!(x > -2 && x < width + 1 && y > -2 && y < height + 1))
+            return 1.0f;
+
+        // texel centers are at integer coordinates
+        float x0 = std::floor(x), y0 = std::floor(y);
+        float fx = x - x0, fy = y - y0;
+        float wx[4] = {1 - fx, 1, 1, fx}, wy[4] = {1 - fy, 1, 1, fy};
+        float lit = 0;
+        for (int j = 0; j < 4; ++j)
+        {
+            for (int i = 0; i < 4; ++i)
+            {
+                int tx = (int)x0 - 1 + i, ty = (int)y0 - 1 + j;
+                bool in_map = tx >= 0 && tx < width && ty >= 0 && ty < height;
+                if (!in_map || z < depth[(height - 1 - ty) * width + tx])
+                    lit += wx[i] * wy[j];
+            }
+        }
+        return lit / 9.0f;
+    }
+
+private:
+    std::vector<float> depth; // rows top to bottom, like the rasterizer's depth buffer
+};
+#endif //RASTERIZER_SHADOWMAP_H
@@ -2,3 +2,63 @@
 // Created by LEI XU on 4/27/19.
 //
 
+#include "Texture.hpp"
+#include <opencv2/opencv.hpp>
+
+Texture::level Texture::make_level(int w, int h)
+{
+    level l;
+    l.width = w;
+    l.height = h;
+    l.tiles_x = (w + tile - 1) / tile;
+    int tiles_y = (h + tile - 1) / tile;
+    l.texels.resize((size_t)4 * l.tiles_x * tiles_y * tile * tile);
+    return l;
+}
+
+Texture::Texture(const std::string& name)
+{
+    cv::Mat image_data = cv::imread(name);
+    cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
+    width = image_data.cols;
+    height = image_data.rows;
+
+    // base level, swizzled into tiles
+    mips.push_back(make_level(width, height));
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            auto color = image_data.at<cv::Vec3b>(y, x);
+            u08* texel = &mips[0].texels[offset(mips[0], x, y)];
+            texel[0] = color[0];
+            texel[1] = color[1];
+            texel[2] = color[2];
+        }
+    }
+
+    // every further level averages 2x2 texels of the previous one, down to 1x1.
+    // Sizes halve rounding down, so an odd size drops its last row/column; only a
+    // size of 1 is clamped, averaging its single row/column with itself
+    while (mips.back().width > 1 || mips.back().height > 1)
+    {
+        const level& src = mips.back();
+        level dst = make_level(std::max(1, src.width / 2), std::max(1, src.height / 2));
+        for (int y = 0; y < dst.height; ++y)
+        {
+            for (int x = 0; x < dst.width; ++x)
+            {
+                int x0 = std::min(2 * x, src.width - 1), x1 = std::min(2 * x + 1, src.width - 1);
+                int y0 = std::min(2 * y, src.height - 1), y1 = std::min(2 * y + 1, src.height - 1);
+                const u08* a = &src.texels[offset(src, x0, y0)];
+                const u08* b = &src.texels[offset(src, x1, y0)];
+                const u08* c = &src.texels[offset(src, x0, y1)];
+                const u08* d = &src.texels[offset(src, x1, y1)];
+                u08* texel = &dst.texels[offset(dst, x, y)];
+                for (int i = 0; i < 3; ++i)
+                    texel[i] = (u08)((a[i] + b[i] + c[i] + d[i] + 2) / 4);
+            }
+        }
+        mips.push_back(std::move(dst));
+    }
+}
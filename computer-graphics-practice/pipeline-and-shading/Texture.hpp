@@ -6,29 +6,105 @@
 #define RASTERIZER_TEXTURE_H
 #include "global.hpp"
 #include <Eigen/Eigen>
-#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+// An RGB texture with a full mip chain. Every level is stored in 4x4 texel tiles,
+// four bytes per texel, so a tile is one 64-byte cache line and a bilinear footprint
+// or a vertical neighbour usually lies in the same line as the texel itself.
 class Texture{
+public:
+    enum class Wrap
+    {
+        Repeat,
+        Clamp
+    };
+
+    Texture(const std::string& name);
+
+    int width, height;
+    Wrap wrap = Wrap::Repeat;
+
+    int levels() const { return (int)mips.size(); }
+
+    // nearest texel of the base level
+    Eigen::Vector3f getColor(float u, float v) const
+    {
+        const level& l = mips[0];
+        return fetch(l, address((int)std::floor(u * l.width), l.width),
+                        address((int)std::floor((1 - v) * l.height), l.height));
+    }
+
+    // bilinear filtering between the four nearest texels of one mip level
+    Eigen::Vector3f getColorBilinear(float u, float v, int lod = 0) const
+    {
+        const level& l = mips[std::clamp(lod, 0, levels() - 1)];
+        float x = u * l.width - 0.5f, y = (1 - v) * l.height - 0.5f;
+        float x0 = std::floor(x), y0 = std::floor(y);
+        float fx = x - x0, fy = y - y0;
+        int ix0 = address((int)x0, l.width), ix1 = address((int)x0 + 1, l.width);
+        int iy0 = address((int)y0, l.height), iy1 = address((int)y0 + 1, l.height);
+
+        Eigen::Vector3f top = (1 - fx) * fetch(l, ix0, iy0) + fx * fetch(l, ix1, iy0);
+        Eigen::Vector3f bottom = (1 - fx) * fetch(l, ix0, iy1) + fx * fetch(l, ix1, iy1);
+        return (1 - fy) * top + fy * bottom;
+    }
+
+    // bilinear filtering on the two mip levels around lod, blended linearly
+    Eigen::Vector3f getColorTrilinear(float u, float v, float lod) const
+    {
+        lod = std::clamp(lod, 0.0f, (float)(levels() - 1));
+        int l0 = (int)lod;
+        float f = lod - l0;
+        if (f == 0)
+            return getColorBilinear(u, v, l0);
+        return (1 - f) * getColorBilinear(u, v, l0) + f * getColorBilinear(u, v, l0 + 1);
+    }
+
+    // Mip level for a pixel footprint given by the screen space derivatives of the
+    // texture coordinates: log2 of the longer footprint axis, in base level texels.
+    float getLod(float du_dx, float dv_dx, float du_dy, float dv_dy) const
+    {
+        float lx = std::hypot(du_dx * width, dv_dx * height);
+        float ly = std::hypot(du_dy * width, dv_dy * height);
+        float rho = std::max(lx, ly);
+        return rho > 1 ? std::log2(rho) : 0.0f;
+    }
+
 private:
-    cv::Mat image_data;
+    static constexpr int tile = 4;
 
-public:
-    Texture(const std::string& name)
+    struct level
+    {
+        int width, height;
+        int tiles_x;
+        std::vector<u08> texels; // tiles in row-major order, texels row-major in a tile
+    };
+
+    std::vector<level> mips;
+
+    int address(int i, int size) const
     {
-        image_data = cv::imread(name);
-        cv::cvtColor(image_data, image_data, cv::COLOR_RGB2BGR);
-        width = image_data.cols;
-        height = image_data.rows;
+        if (wrap == Wrap::Clamp)
+            return std::clamp(i, 0, size - 1);
+        i %= size;
+        return i < 0 ? i + size : i;
     }
 
-    int width, height;
+    static size_t offset(const level& l, int x, int y)
+    {
+        size_t t = (size_t)(y / tile) * l.tiles_x + x / tile;
+        return 4 * (t * tile * tile + (y % tile) * tile + x % tile);
+    }
 
-    Eigen::Vector3f getColor(float u, float v)
+    static Eigen::Vector3f fetch(const level& l, int x, int y)
     {
-        auto u_img = u * width;
-        auto v_img = (1 - v) * height;
-        auto color = image_data.at<cv::Vec3b>(v_img, u_img);
-        return Eigen::Vector3f(color[0], color[1], color[2]);
+        const u08* texel = &l.texels[offset(l, x, y)];
+        return Eigen::Vector3f(texel[0], texel[1], texel[2]);
     }
 
+    static level make_level(int w, int h);
 };
 #endif //RASTERIZER_TEXTURE_H
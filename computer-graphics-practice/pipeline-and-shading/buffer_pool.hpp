@@ -0,0 +1,140 @@
+//
+// Vertex and index buffer storage of the rasterizer.
+//
+
+#pragma once
+
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+namespace rst
+{
+    // A read-only view of size contiguous elements that someone else owns, like the
+    // C++20 std::span.
+    template <typename T>
+    struct buffer_view
+    {
+        const T* data = nullptr;
+        size_t size = 0;
+
+        buffer_view() = default;
+        buffer_view(const T* data, size_t size) : data(data), size(size) {}
+        buffer_view(const std::vector<T>& v) : data(v.data()), size(v.size()) {}
+
+        const T& operator[](size_t i) const { return data[i]; }
+        const T* begin() const { return data; }
+        const T* end() const { return data + size; }
+        bool empty() const { return size == 0; }
+    };
+
+    // Index of a buffer in its pool plus the generation of the slot it was created in.
+    // Slot generations start at 1, so a default-constructed handle is never valid.
+    struct buffer_handle
+    {
+        int index = 0;
+        unsigned generation = 0;
+    };
+
+    // Buffers in a dense array of slots. Freed slots are reused, and every reuse bumps
+    // the slot's generation, so a handle to a freed buffer is caught instead of silently
+    // reading whatever replaced it. A buffer either owns a vector (adopted by move, so a
+    // caller handing over its vector pays no copy) or borrows memory the caller keeps
+    // alive until the buffer is updated or freed. Lookups are an index and a compare.
+    template <typename T>
+    class buffer_pool
+    {
+    public:
+        buffer_handle adopt(std::vector<T> data)
+        {
+            buffer_handle h = allocate();
+            update(h, std::move(data));
+            return h;
+        }
+
+        buffer_handle borrow(buffer_view<T> data)
+        {
+            buffer_handle h = allocate();
+            update(h, data);
+            return h;
+        }
+
+        // replaces the contents, the handle stays valid
+        void update(buffer_handle h, std::vector<T> data)
+        {
+            slot& s = checked(h);
+            s.owned = std::move(data);
+            s.view = buffer_view<T>(s.owned);
+        }
+
+        void update(buffer_handle h, buffer_view<T> data)
+        {
+            slot& s = checked(h);
+            s.owned = {};
+            s.view = data;
+        }
+
+        void free(buffer_handle h)
+        {
+            slot& s = checked(h);
+            s.owned = {};
+            s.view = {};
+            s.live = false;
+            ++s.generation;
+            free_slots.push_back(h.index);
+        }
+
+        buffer_view<T> get(buffer_handle h) const
+        {
+            if (!valid(h))
+            {
+                throw std::runtime_error("Invalid or freed buffer handle!");
+            }
+            return slots[h.index].view;
+        }
+
+        bool valid(buffer_handle h) const
+        {
+            return h.index >= 0 && h.index < (int)slots.size() && slots[h.index].live &&
+                   slots[h.index].generation == h.generation;
+        }
+
+    private:
+        struct slot
+        {
+            std::vector<T> owned;
+            buffer_view<T> view;
+            unsigned generation = 1;
+            bool live = false;
+        };
+
+        buffer_handle allocate()
+        {
+            int index;
+            if (free_slots.empty())
+            {
+                index = slots.size();
+                slots.emplace_back();
+            }
+            else
+            {
+                index = free_slots.back();
+                free_slots.pop_back();
+            }
+            slots[index].live = true;
+            return {index, slots[index].generation};
+        }
+
+        slot& checked(buffer_handle h)
+        {
+            if (!valid(h))
+            {
+                throw std::runtime_error("Invalid or freed buffer handle!");
+            }
+            return slots[h.index];
+        }
+
+        std::vector<slot> slots;
+        std::vector<int> free_slots;
+    };
+}
@@ -1,4 +1,6 @@
+#include <chrono>
 #include <iostream>
+#include <random>
 #include <opencv2/opencv.hpp>
 
 #include "global.hpp"
@@ -7,6 +9,8 @@
 #include "Shader.hpp"
 #include "Texture.hpp"
 #include "OBJ_Loader.h"
+#include "frame_writer.hpp"
+#include "LightGrid.hpp"
 
 inline float deg2rad(float degrees) { return degrees * MY_PI / 180.0; }
 
@@ -25,6 +29,21 @@ Eigen::Matrix4f get_view_matrix(Eigen::Vector3f eye_pos)
     return view;
 }
 
+// View matrix of a camera at eye looking at target, for rendering from the lights.
+Eigen::Matrix4f look_at(const Eigen::Vector3f& eye, const Eigen::Vector3f& target, const Eigen::Vector3f& up)
+{
+    Eigen::Vector3f f = (target - eye).normalized();
+    Eigen::Vector3f s = f.cross(up).normalized();
+    Eigen::Vector3f u = s.cross(f);
+
+    Eigen::Matrix4f view;
+    view << s.x(), s.y(), s.z(), -s.dot(eye),
+            u.x(), u.y(), u.z(), -u.dot(eye),
+            -f.x(), -f.y(), -f.z(), f.dot(eye),
+            0, 0, 0, 1;
+    return view;
+}
+
 Eigen::Matrix4f get_model_matrix(float angle)
 {
     Eigen::Matrix4f rotation;
@@ -66,278 +85,216 @@ Eigen::Vector3f vertex_shader(const vertex_shader_payload& payload)
     return payload.position;
 }
 
-Eigen::Vector3f normal_fragment_shader(const fragment_shader_payload& payload)
+// Calls visit(light) for the lights that may reach pixel (x, y): the pixel's tile list
+// of the light grid, or all lights without one.
+template <typename Visit>
+static void for_each_light(const shading_uniforms& u, int x, int y, Visit&& visit)
 {
-    Eigen::Vector3f return_color = (payload.normal.head<3>().normalized() + Eigen::Vector3f(1.0f, 1.0f, 1.0f)) / 2.f;
-    Eigen::Vector3f result;
-    result << return_color.x() * 255, return_color.y() * 255, return_color.z() * 255;
-    return result;
+    if (u.light_grid)
+    {
+        for (int k : u.light_grid->lights_at(x, y))
+            visit(u.lights[k]);
+    }
+    else
+    {
+        for (auto& light : u.lights)
+            visit(light);
+    }
 }
 
-static Eigen::Vector3f reflect(const Eigen::Vector3f& vec, const Eigen::Vector3f& axis)
+// The fragment shaders evaluate all eight lanes of a fragment_shader_batch with
+// Eigen array expressions.
+using lanes = fragment_shader_batch::lanes;
+using lanes3 = fragment_shader_batch::lanes3;
+
+static lanes dot(const lanes3& a, const lanes3& b)
 {
-    auto costheta = vec.dot(axis);
-    return (2 * costheta * axis - vec).normalized();
+    return a.col(0) * b.col(0) + a.col(1) * b.col(1) + a.col(2) * b.col(2);
 }
 
-struct light
+static lanes3 cross(const lanes3& a, const lanes3& b)
 {
-    Eigen::Vector3f position;
-    Eigen::Vector3f intensity;
-};
+    lanes3 c;
+    c.col(0) = a.col(1) * b.col(2) - a.col(2) * b.col(1);
+    c.col(1) = a.col(2) * b.col(0) - a.col(0) * b.col(2);
+    c.col(2) = a.col(0) * b.col(1) - a.col(1) * b.col(0);
+    return c;
+}
 
-Eigen::Vector3f texture_fragment_shader(const fragment_shader_payload& payload)
+static lanes3 normalized(const lanes3& v)
 {
-    Eigen::Vector3f return_color = {0, 0, 0};
-    if (payload.texture)
-    {
-        // TODO: Get the texture value at the texture coordinates of the current fragment
-        auto u = payload.tex_coords.x();
-        auto v = payload.tex_coords.y();
-        return_color = payload.texture->getColor(u, v);
-    }
-    Eigen::Vector3f texture_color;
-    texture_color << return_color.x(), return_color.y(), return_color.z();
-
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = texture_color / 255.f;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = texture_color;
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
-
-    Eigen::Vector3f result_color = {0, 0, 0};
+    lanes inv_norm = dot(v, v).rsqrt();
+    lanes3 n;
+    for (int c = 0; c < 3; ++c)
+        n.col(c) = v.col(c) * inv_norm;
+    return n;
+}
 
+// The lanes of a batch share one tile of the light grid.
+static lanes3 blinn_phong(const shading_uniforms& u, const lanes3& kd, const lanes3& point, const lanes3& normal,
+                          int x, int y)
+{
+    lanes3 to_eye, to_light;
+    for (int c = 0; c < 3; ++c)
+        to_eye.col(c) = u.eye_pos[c] - point.col(c);
     // view
-    Eigen::Vector3f v = (eye_pos - point).normalized();
-    for (auto& light : lights)
-    {
-        // For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        // incidence light
-        Eigen::Vector3f l = (light.position - point).normalized();
+    lanes3 v = normalized(to_eye);
+
+    lanes3 result_color;
+    for (int c = 0; c < 3; ++c)
+        result_color.col(c) = u.ka[c] * u.amb_light_intensity[c];
+    for_each_light(u, x, y, [&](const light& light) {
+        for (int c = 0; c < 3; ++c)
+            to_light.col(c) = light.position[c] - point.col(c);
         // distance
-        float rr = (light.position - point).squaredNorm();
-        Eigen::Vector3f ambient = {0,0,0};
-        Eigen::Vector3f diffuse = {0,0,0};
-        Eigen::Vector3f specular = {0,0,0};
-
-        for (int i=0; i<3; ++i){
-            ambient[i] = ka[i] * amb_light_intensity[i];
-            diffuse[i] = kd[i] * light.intensity[i] / rr * std::max(0.f, normal.dot(l));
-            Eigen::Vector3f h = (v + l).normalized();
-            specular[i] = ks[i] * light.intensity[i] / rr * std::max(0.f, std::pow(normal.dot(h), p));
+        lanes rr = dot(to_light, to_light);
+        lanes inv_dist = rr.rsqrt();
+        lanes inv_rr = inv_dist.square();
+        if (std::isfinite(light.radius))
+        {
+            // Smooth window on the inverse square falloff, 1 at the light and 0 from its
+            // radius on, so a light can be left out wherever it is out of reach. The tile
+            // may be in reach while these pixels are not.
+            lanes t = rr * (1 / (light.radius * light.radius));
+            if ((t >= 1.f).all())
+                return;
+            inv_rr *= (1 - t.square()).max(0.f).square();
         }
-        result_color += ambient + diffuse + specular;
-    }
+        // incidence light
+        lanes3 l;
+        for (int c = 0; c < 3; ++c)
+            l.col(c) = to_light.col(c) * inv_dist;
+        lanes3 h = normalized(v + l);
+
+        // pow() has no packet version, exp(p * log(x)) vectorizes. Results that would
+        // underflow are flushed to zero up front, denormals are slow to compute with.
+        lanes diffuse = dot(normal, l).max(0.f) * inv_rr;
+        lanes spec_exponent = u.p * dot(normal, h).max(0.f).log();
+        lanes specular = (spec_exponent > -80.f).select(spec_exponent.max(-80.f).exp() * inv_rr, 0.f);
+        if (light.shadow)
+        {
+            for (int i = 0; i < fragment_shader_batch::size; ++i)
+            {
+                float visibility = light.shadow->visibility(point.row(i).matrix().transpose());
+                diffuse[i] *= visibility;
+                specular[i] *= visibility;
+            }
+        }
+
+        for (int c = 0; c < 3; ++c)
+            result_color.col(c) += kd.col(c) * (light.intensity[c] * diffuse) +
+                                   u.ks[c] * light.intensity[c] * specular;
+    });
 
-    return result_color * 255.f;
+    return result_color;
 }
 
-Eigen::Vector3f phong_fragment_shader(const fragment_shader_payload& payload)
+// texture color of every active lane, black for the others
+static lanes3 sample(const fragment_shader_batch& batch, const lanes& tu, const lanes& tv)
 {
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
+    lanes3 color = lanes3::Zero();
+    for (int i = 0; i < fragment_shader_batch::size; ++i)
+        if (batch.active[i])
+            color.row(i) = batch.texture->getColor(tu[i], tv[i]).transpose().array();
+    return color;
+}
 
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
+// Height map lookups and perturbed normals shared by the bump and displacement shaders:
+//    n = normal = (x, y, z)
+//    t = (x*y/sqrt(x*x+z*z), sqrt(x*x+z*z), z*y/sqrt(x*x+z*z)), b = n x t
+//    dU = kh * kn * (h(u+1/w,v) - h(u,v)), dV = kh * kn * (h(u,v+1/h) - h(u,v))
+//    perturbed normal = normalize(TBN * (-dU, -dV, 1))
+static lanes3 bump_normal(const fragment_shader_batch& batch, const shading_uniforms& u, lanes& huv)
+{
+    const lanes3& n = batch.normal;
+    lanes x = n.col(0), y = n.col(1), z = n.col(2);
+    lanes xz = (x * x + z * z).sqrt();
+    lanes3 t;
+    t << x * y / xz, xz, z * y / xz;
+    lanes3 b = cross(n, t);
+
+    float w = batch.texture->width, h = batch.texture->height;
+    lanes tu = batch.tex_coords.col(0), tv = batch.tex_coords.col(1);
+    auto height = [&](const lanes& su, const lanes& sv) -> lanes {
+        lanes3 c = sample(batch, su, sv);
+        return dot(c, c).sqrt();
+    };
+    huv = height(tu, tv);
+    lanes dU = u.kh * u.kn * (height(tu + 1.0f / w, tv) - huv);
+    lanes dV = u.kh * u.kn * (height(tu, tv + 1.0f / h) - huv);
+
+    // TBN * (-dU, -dV, 1)
+    lanes3 perturbed;
+    for (int c = 0; c < 3; ++c)
+        perturbed.col(c) = n.col(c) - t.col(c) * dU - b.col(c) * dV;
+    return normalized(perturbed);
+}
 
-    float p = 150;
+lanes3 normal_fragment_shader(const fragment_shader_batch& batch)
+{
+    return (batch.normal + 1.0f) / 2.f * 255;
+}
 
-    Eigen::Vector3f color = payload.color;
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
+// trilinearly filtered texture color of every active lane, with the mip level
+// chosen from the texture coordinate derivatives across each quad
+static lanes3 sample_filtered(const fragment_shader_batch& batch)
+{
+    lanes tu = batch.tex_coords.col(0), tv = batch.tex_coords.col(1);
+    lanes du_dx = fragment_shader_batch::ddx(tu), dv_dx = fragment_shader_batch::ddx(tv);
+    lanes du_dy = fragment_shader_batch::ddy(tu), dv_dy = fragment_shader_batch::ddy(tv);
 
-    Eigen::Vector3f result_color = {0, 0, 0};
-    // view
-    Eigen::Vector3f v = (eye_pos - point).normalized();
-    for (auto& light : lights)
+    lanes3 color = lanes3::Zero();
+    for (int i = 0; i < fragment_shader_batch::size; ++i)
     {
-        // For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        // incidence light
-        Eigen::Vector3f l = (light.position - point).normalized();
-        // distance
-        float rr = (light.position - point).squaredNorm();
-        Eigen::Vector3f ambient = {0,0,0};
-        Eigen::Vector3f diffuse = {0,0,0};
-        Eigen::Vector3f specular = {0,0,0};
-
-        for (int i=0; i<3; ++i){
-            ambient[i] = ka[i] * amb_light_intensity[i];
-            diffuse[i] = kd[i] * light.intensity[i] / rr * std::max(0.f, normal.dot(l));
-            Eigen::Vector3f h = (v + l).normalized();
-            specular[i] = ks[i] * light.intensity[i] / rr * std::max(0.f, std::pow(normal.dot(h), p));
-        }
-        result_color += ambient + diffuse + specular;
+        if (!batch.active[i]) continue;
+        float lod = batch.texture->getLod(du_dx[i], dv_dx[i], du_dy[i], dv_dy[i]);
+        color.row(i) = batch.texture->getColorTrilinear(tu[i], tv[i], lod).transpose().array();
     }
-
-    return result_color * 255.f;
+    return color;
 }
 
+lanes3 texture_fragment_shader(const fragment_shader_batch& batch, const shading_uniforms& u)
+{
+    lanes3 texture_color = lanes3::Zero();
+    if (batch.texture)
+        texture_color = sample_filtered(batch);
+
+    return blinn_phong(u, texture_color / 255.f, batch.view_pos, batch.normal, batch.x, batch.y) * 255.f;
+}
 
+lanes3 phong_fragment_shader(const fragment_shader_batch& batch, const shading_uniforms& u)
+{
+    return blinn_phong(u, batch.color, batch.view_pos, batch.normal, batch.x, batch.y) * 255.f;
+}
 
-Eigen::Vector3f displacement_fragment_shader(const fragment_shader_payload& payload)
+lanes3 displacement_fragment_shader(const fragment_shader_batch& batch, const shading_uniforms& u)
 {
-    // this payload is using a height map
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
-
-    float kh = 0.2, kn = 0.1;
-    
-    // Implement displacement mapping here
-    // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
-    // Matrix TBN = [t b n]
-    // dU = kh * kn * (h(u+1/w,v)-h(u,v))
-    // dV = kh * kn * (h(u,v+1/h)-h(u,v))
-    // Vector ln = (-dU, -dV, 1)
-    // Position p = p + kn * n * h(u,v)
-    // Normal n = normalize(TBN * ln)
-
-    float x = normal.x(), y = normal.y(), z = normal.z();
-    // Vector t is the tangent vector follows the u direction
-    Eigen::Vector3f t = {x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z)};
-    // Vector b is the bitangent vector follows the v direction
-    Eigen::Vector3f b = normal.cross(t);
-    Eigen::Matrix3f TBN;
-    TBN.col(0) = t;
-    TBN.col(1) = b;
-    TBN.col(2) = normal;
-    // Perturb normal vector is (dU, dV, 1).normalization()
-    int w = payload.texture->width, h = payload.texture->height;
-    float u = payload.tex_coords.x(), v = payload.tex_coords.y();
-    auto huv = payload.texture->getColor(u, v).norm();
-
-    float dU = kh * kn * (payload.texture->getColor(u+1.0f/w, v).norm() - huv);
-    float dV = kh * kn * (payload.texture->getColor(u, v+1.0f/h).norm() - huv);
-
-    Eigen::Vector3f ln = {-dU, -dV, 1};
-    normal = (TBN * ln).normalized();
-    point = point + kn * normal * huv;
-
-
-    Eigen::Vector3f result_color = {0, 0, 0};
-    Eigen::Vector3f view = (eye_pos - point).normalized();
-
-    for (auto& light : lights)
-    {
-        // For each light source in the code, calculate what the *ambient*, *diffuse*, and *specular* 
-        // components are. Then, accumulate that result on the *result_color* object.
-        // incidence light
-        Eigen::Vector3f l = (light.position - point).normalized();
-        // distance
-        float rr = (light.position - point).squaredNorm();
-        Eigen::Vector3f ambient = {0,0,0};
-        Eigen::Vector3f diffuse = {0,0,0};
-        Eigen::Vector3f specular = {0,0,0};
-
-        for (int i=0; i<3; ++i){
-            ambient[i] = ka[i] * amb_light_intensity[i];
-            diffuse[i] = kd[i] * light.intensity[i] / rr * std::max(0.f, normal.dot(l));
-            Eigen::Vector3f h = (view + l).normalized();
-            specular[i] = ks[i] * light.intensity[i] / rr * std::max(0.f, std::pow(normal.dot(h), p));
-        }
-        result_color += ambient + diffuse + specular;
-    }
+    lanes huv;
+    lanes3 normal = bump_normal(batch, u, huv);
+    lanes3 point;
+    for (int c = 0; c < 3; ++c)
+        point.col(c) = batch.view_pos.col(c) + u.kn * normal.col(c) * huv;
 
-    return result_color * 255.f;
+    return blinn_phong(u, batch.color, point, normal, batch.x, batch.y) * 255.f;
 }
 
-
-Eigen::Vector3f bump_fragment_shader(const fragment_shader_payload& payload)
+lanes3 bump_fragment_shader(const fragment_shader_batch& batch, const shading_uniforms& u)
 {
-    // this payload is using a height map
-    Eigen::Vector3f ka = Eigen::Vector3f(0.005, 0.005, 0.005);
-    Eigen::Vector3f kd = payload.color;
-    Eigen::Vector3f ks = Eigen::Vector3f(0.7937, 0.7937, 0.7937);
-
-    auto l1 = light{{20, 20, 20}, {500, 500, 500}};
-    auto l2 = light{{-20, 20, 0}, {500, 500, 500}};
-
-    std::vector<light> lights = {l1, l2};
-    Eigen::Vector3f amb_light_intensity{10, 10, 10};
-    Eigen::Vector3f eye_pos{0, 0, 10};
-
-    float p = 150;
-
-    Eigen::Vector3f color = payload.color; 
-    Eigen::Vector3f point = payload.view_pos;
-    Eigen::Vector3f normal = payload.normal;
-
-
-    float kh = 0.2, kn = 0.1;
-
-    // TODO: Implement bump mapping here
-    // Let n = normal = (x, y, z)
-    // Vector t = (x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z))
-    // Vector b = n cross product t
-    // Matrix TBN = [t b n]
-    // dU = kh * kn * (h(u+1/w,v)-h(u,v))
-    // dV = kh * kn * (h(u,v+1/h)-h(u,v))
-    // Vector ln = (-dU, -dV, 1)
-    // Normal n = normalize(TBN * ln)
-
-    float x = normal.x(), y = normal.y(), z = normal.z();
-    // Vector t is the tangent vector follows the u direction
-    Eigen::Vector3f t = {x*y/sqrt(x*x+z*z),sqrt(x*x+z*z),z*y/sqrt(x*x+z*z)};
-    // Vector b is the bitangent vector follows the v direction
-    Eigen::Vector3f b = normal.cross(t);
-    Eigen::Matrix3f TBN;
-    TBN.col(0) = t;
-    TBN.col(1) = b;
-    TBN.col(2) = normal;
-    // Perturb normal vector is (dU, dV, 1).normalization()
-    int w = payload.texture->width, h = payload.texture->height;
-    float u = payload.tex_coords.x(), v = payload.tex_coords.y();
-    auto huv = payload.texture->getColor(u, v).norm();
-
-    float dU = kh * kn * (payload.texture->getColor(u+1.0f/w, v).norm() - huv);
-    float dV = kh * kn * (payload.texture->getColor(u, v+1.0f/h).norm() - huv);
-
-    Eigen::Vector3f ln = {-dU, -dV, 1};
-    normal = (TBN * ln).normalized();
-
-    Eigen::Vector3f result_color = {0, 0, 0};
-    result_color = normal;
-
-    return result_color * 255.f;
+    lanes huv;
+    return bump_normal(batch, u, huv) * 255.f;
 }
 
-int main(int argc, const char** argv)
+enum class shader_kind
 {
-    std::vector<Triangle*> TriangleList;
+    phong,
+    normal,
+    texture,
+    bump,
+    displacement
+};
 
+int main(int argc, const char** argv)
+{
     float angle = 140.0;
     bool command_line = false;
 
@@ -346,104 +303,239 @@ int main(int argc, const char** argv)
     std::string obj_path = "../models/spot/";
 
     // Load .obj File
+    // The loader emits three vertices per face, so corners with identical attributes
+    // are merged into one indexed vertex and the rasterizer transforms each only once.
+    std::vector<rst::vertex> vertices;
+    std::vector<Eigen::Vector3i> indices;
+    std::map<std::array<float, 8>, int> vertex_ids;
+
     bool loadout = Loader.LoadFile("../models/spot/spot_triangulated_good.obj");
     for(auto mesh:Loader.LoadedMeshes)
     {
         for(int i=0;i<mesh.Vertices.size();i+=3)
         {
-            Triangle* t = new Triangle();
+            Eigen::Vector3i face;
             for(int j=0;j<3;j++)
             {
-                t->setVertex(j,Vector4f(mesh.Vertices[i+j].Position.X,mesh.Vertices[i+j].Position.Y,mesh.Vertices[i+j].Position.Z,1.0));
-                t->setNormal(j,Vector3f(mesh.Vertices[i+j].Normal.X,mesh.Vertices[i+j].Normal.Y,mesh.Vertices[i+j].Normal.Z));
-                t->setTexCoord(j,Vector2f(mesh.Vertices[i+j].TextureCoordinate.X, mesh.Vertices[i+j].TextureCoordinate.Y));
+                const auto& vert = mesh.Vertices[i+j];
+                std::array<float, 8> key = {vert.Position.X, vert.Position.Y, vert.Position.Z,
+                                            vert.Normal.X, vert.Normal.Y, vert.Normal.Z,
+                                            vert.TextureCoordinate.X, vert.TextureCoordinate.Y};
+                auto [it, inserted] = vertex_ids.emplace(key, (int)vertices.size());
+                if (inserted)
+                {
+                    vertices.push_back({{vert.Position.X, vert.Position.Y, vert.Position.Z},
+                                        {vert.Normal.X, vert.Normal.Y, vert.Normal.Z},
+                                        {148, 121, 92},
+                                        {vert.TextureCoordinate.X, vert.TextureCoordinate.Y}});
+                }
+                face[j] = it->second;
             }
-            TriangleList.push_back(t);
+            indices.push_back(face);
         }
     }
 
     rst::rasterizer r(700, 700);
 
+    // both rasterizers read the mesh in place
+    auto vtx_id = r.borrow_vertices(vertices);
+    auto ind_id = r.borrow_indices(indices);
+    // spot is a closed mesh, its back faces are always hidden
+    r.set_cull_mode(rst::Cull::Back);
+
+    // Depth-only pass from every light. The shadow maps hold the back faces as seen from
+    // the light, so lit front faces are far from their own depth and need little bias.
+    const int shadow_size = 1024;
+    rst::rasterizer shadow_r(shadow_size, shadow_size);
+    auto shadow_vtx_id = shadow_r.borrow_vertices(vertices);
+    auto shadow_ind_id = shadow_r.borrow_indices(indices);
+    shadow_r.set_cull_mode(rst::Cull::Front);
+    // radius of the model around its origin, which the model matrix only rotates
+    float model_radius = 0;
+    for (const auto& v : vertices)
+        model_radius = std::max(model_radius, (get_model_matrix(0).topLeftCorner<3, 3>() * v.position).norm());
+    std::vector<ShadowMap> shadow_maps;
+
     auto texture_path = "hmap.jpg";
     r.set_texture(Texture(obj_path + texture_path));
 
-    std::function<Eigen::Vector3f(fragment_shader_payload)> active_shader = phong_fragment_shader;
+    shader_kind active_shader = shader_kind::phong;
 
-    if (argc >= 2)
+    // Rasterizer [--frames N] [--lights N] output.png [shader]. With --frames, N frames of
+    // a full turn of the model are rendered headless to output0000.png, output0001.png, ...
+    // --lights adds N small colored point lights around the model.
+    std::vector<std::string> args(argv + 1, argv + argc);
+    int frames = 0;
+    int local_lights = 0;
+    while (args.size() >= 2 && (args[0] == "--frames" || args[0] == "--lights"))
+    {
+        (args[0] == "--frames" ? frames : local_lights) = std::max(1, std::stoi(args[1]));
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    if (!args.empty())
     {
         command_line = true;
-        filename = std::string(argv[1]);
+        filename = args[0];
 
-        if (argc == 3 && std::string(argv[2]) == "texture")
+        if (args.size() == 2 && args[1] == "texture")
         {
             std::cout << "Rasterizing using the texture shader\n";
-            active_shader = texture_fragment_shader;
+            active_shader = shader_kind::texture;
             texture_path = "spot_texture.png";
             r.set_texture(Texture(obj_path + texture_path));
         }
-        else if (argc == 3 && std::string(argv[2]) == "normal")
+        else if (args.size() == 2 && args[1] == "normal")
         {
             std::cout << "Rasterizing using the normal shader\n";
-            active_shader = normal_fragment_shader;
+            active_shader = shader_kind::normal;
         }
-        else if (argc == 3 && std::string(argv[2]) == "phong")
+        else if (args.size() == 2 && args[1] == "phong")
         {
             std::cout << "Rasterizing using the phong shader\n";
-            active_shader = phong_fragment_shader;
+            active_shader = shader_kind::phong;
         }
-        else if (argc == 3 && std::string(argv[2]) == "bump")
+        else if (args.size() == 2 && args[1] == "bump")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = bump_fragment_shader;
+            active_shader = shader_kind::bump;
         }
-        else if (argc == 3 && std::string(argv[2]) == "displacement")
+        else if (args.size() == 2 && args[1] == "displacement")
         {
             std::cout << "Rasterizing using the bump shader\n";
-            active_shader = displacement_fragment_shader;
+            active_shader = shader_kind::displacement;
         }
     }
 
     Eigen::Vector3f eye_pos = {0,0,10};
 
     r.set_vertex_shader(vertex_shader);
-    r.set_fragment_shader(active_shader);
+
+    // Each shader gets its own instantiation of the raster loop, with the uniforms
+    // set up once here rather than in every fragment. The shaders are called with
+    // whole fragment_shader_batch groups.
+    shading_uniforms uniforms;
+
+    // Local lights hovering just above the surface, each reaching a small patch of it.
+    // The light grid hands every pixel only the few lights of its tile.
+    std::mt19937 rng(1);
+    std::uniform_real_distribution<float> uniform(-1, 1);
+    Eigen::Vector3f model_center = (get_view_matrix(eye_pos) * Eigen::Vector4f(0, 0, 0, 1)).head<3>();
+    for (int k = 0; k < local_lights; ++k)
+    {
+        Eigen::Vector3f direction;
+        do
+            direction = {uniform(rng), uniform(rng), uniform(rng)};
+        while (direction.squaredNorm() > 1 || direction.squaredNorm() < 1e-4);
+        Eigen::Vector3f color = Eigen::Vector3f(uniform(rng), uniform(rng), uniform(rng)).cwiseAbs();
+        light local{model_center + direction.normalized() * (model_radius + 0.3f), color / color.maxCoeff() * 0.05f};
+        local.radius = 1.0f;
+        uniforms.lights.push_back(local);
+    }
+    LightGrid light_grid(700, 700);
+    uniforms.light_grid = &light_grid;
+
+    // one frame of the model turned by model_angle
+    auto draw = [&](float model_angle) {
+        Eigen::Matrix4f model = get_model_matrix(model_angle);
+        Eigen::Matrix4f view = get_view_matrix(eye_pos);
+
+        // every distant light looks at the model with a frustum just enclosing it, the
+        // local ones cast no shadows
+        Eigen::Vector3f center = (view * model).col(3).head<3>();
+        shadow_maps.clear();
+        shadow_maps.reserve(uniforms.lights.size());
+        for (auto& light : uniforms.lights)
+        {
+            if (std::isfinite(light.radius))
+                continue;
+            float distance = (center - light.position).norm();
+            float fov = 2 * std::asin(std::min(1.0f, model_radius / distance)) * 180 / MY_PI;
+            Eigen::Matrix4f light_view = look_at(light.position, center, {0, 1, 0});
+            Eigen::Matrix4f light_projection = get_projection_matrix(fov, 1, std::max(0.1f, distance - model_radius),
+                                                                     distance + model_radius);
+            shadow_r.clear(rst::Buffers::Depth);
+            shadow_r.set_model(model);
+            shadow_r.set_view(light_view * view);
+            shadow_r.set_projection(light_projection);
+            shadow_r.draw_depth(shadow_vtx_id, shadow_ind_id);
+            light.shadow = &shadow_maps.emplace_back(shadow_size, shadow_size, light_projection * light_view,
+                                                     shadow_r.depth_buffer());
+        }
+
+        Eigen::Matrix4f projection = get_projection_matrix(45.0, 1, 0.1, 50);
+        light_grid.build(uniforms.lights, projection);
+
+        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+        r.set_model(model);
+        r.set_view(view);
+        r.set_projection(projection);
+
+        auto draw_with = [&](auto shader) {
+            r.draw(vtx_id, ind_id, rst::Primitive::Triangle,
+                   [&](const fragment_shader_batch& batch) { return shader(batch, uniforms); });
+        };
+        switch (active_shader)
+        {
+            case shader_kind::phong: draw_with([](auto& p, auto& u) { return phong_fragment_shader(p, u); }); break;
+            case shader_kind::normal: draw_with([](auto& p, auto&) { return normal_fragment_shader(p); }); break;
+            case shader_kind::texture: draw_with([](auto& p, auto& u) { return texture_fragment_shader(p, u); }); break;
+            case shader_kind::bump: draw_with([](auto& p, auto& u) { return bump_fragment_shader(p, u); }); break;
+            case shader_kind::displacement: draw_with([](auto& p, auto& u) { return displacement_fragment_shader(p, u); }); break;
+        }
+    };
 
     int key = 0;
     int frame_count = 0;
 
-    if (command_line)
+    if (frames > 0)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-        r.set_model(get_model_matrix(angle));
-        r.set_view(get_view_matrix(eye_pos));
-        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
-
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        // "out.png" -> "out0042.png"
+        auto frame_name = [&](int i) {
+            std::string number = std::to_string(i);
+            number.insert(0, std::max(0, 4 - (int)number.size()), '0');
+            size_t dot = filename.rfind('.');
+            return dot == std::string::npos ? filename + number : filename.substr(0, dot) + number + filename.substr(dot);
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            frame_writer writer(700, 700);
+            for (int i = 0; i < frames; ++i)
+            {
+                draw(angle + 360.0f * i / frames);
+                // hand the finished frame to the writer and render the next one into a
+                // recycled buffer, which clear() resets
+                std::vector<u08> pixels = writer.acquire();
+                std::swap(pixels, r.frame_buffer());
+                writer.push(frame_name(i), std::move(pixels));
+            }
+        }
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        std::cout << frames << " frames in " << seconds.count() << " s, "
+                  << frames / seconds.count() << " frames/s\n";
+        return 0;
+    }
 
+    if (command_line)
+    {
+        draw(angle);
+        cv::Mat image(700, 700, CV_8UC3, r.frame_buffer().data());
         cv::imwrite(filename, image);
 
         return 0;
     }
 
+    // the preview is written in the background while the next frame renders
+    frame_writer writer(700, 700);
     while(key != 27)
     {
-        r.clear(rst::Buffers::Color | rst::Buffers::Depth);
-
-        r.set_model(get_model_matrix(angle));
-        r.set_view(get_view_matrix(eye_pos));
-        r.set_projection(get_projection_matrix(45.0, 1, 0.1, 50));
-
-        //r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle);
-        r.draw(TriangleList);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
+        draw(angle);
+        cv::Mat image(700, 700, CV_8UC3, r.frame_buffer().data());
         cv::imshow("image", image);
-        cv::imwrite(filename, image);
+        std::vector<u08> pixels = writer.acquire();
+        std::swap(pixels, r.frame_buffer());
+        writer.push(filename, std::move(pixels));
         key = cv::waitKey(10);
 
         if (key == 'a' )
@@ -6,42 +6,137 @@
 #include "rasterizer.hpp"
 #include <opencv2/opencv.hpp>
 #include <math.h>
+#include <atomic>
+#include <thread>
 
 
-rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3f> &positions)
+// Bounding sphere around the center of the bounding box, for frustum culling.
+void rst::rasterizer::set_bounds(std::vector<Eigen::Vector4f>& bounds, int slot, const float* positions, int n, int stride)
 {
-    auto id = get_next_id();
-    pos_buf.emplace(id, positions);
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity()), hi = -lo;
+    for (int i = 0; i < n; ++i)
+    {
+        Eigen::Map<const Eigen::Vector3f> p(positions + i * stride);
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    Eigen::Vector3f center = n == 0 ? Eigen::Vector3f::Zero() : Eigen::Vector3f(0.5f * (lo + hi));
+    float radius = 0;
+    for (int i = 0; i < n; ++i)
+        radius = std::max(radius, (Eigen::Map<const Eigen::Vector3f>(positions + i * stride) - center).squaredNorm());
+
+    if (slot >= (int)bounds.size())
+        bounds.resize(slot + 1);
+    bounds[slot] << center, std::sqrt(radius);
+}
+
+rst::pos_buf_id rst::rasterizer::load_positions(std::vector<Eigen::Vector3f> positions)
+{
+    auto h = pos_buf.adopt(std::move(positions));
+    auto view = pos_buf.get(h);
+    set_bounds(pos_bounds, h.index, view.empty() ? nullptr : view[0].data(), view.size, 3);
+    return {h.index, h.generation};
+}
+
+rst::pos_buf_id rst::rasterizer::borrow_positions(buffer_view<Eigen::Vector3f> positions)
+{
+    auto h = pos_buf.borrow(positions);
+    set_bounds(pos_bounds, h.index, positions.empty() ? nullptr : positions[0].data(), positions.size, 3);
+    return {h.index, h.generation};
+}
+
+void rst::rasterizer::update_positions(pos_buf_id id, std::vector<Eigen::Vector3f> positions)
+{
+    pos_buf.update(handle(id), std::move(positions));
+    auto view = pos_buf.get(handle(id));
+    set_bounds(pos_bounds, id.pos_id, view.empty() ? nullptr : view[0].data(), view.size, 3);
+}
+
+void rst::rasterizer::update_positions(pos_buf_id id, buffer_view<Eigen::Vector3f> positions)
+{
+    pos_buf.update(handle(id), positions);
+    set_bounds(pos_bounds, id.pos_id, positions.empty() ? nullptr : positions[0].data(), positions.size, 3);
+}
+
+rst::ind_buf_id rst::rasterizer::load_indices(std::vector<Eigen::Vector3i> indices)
+{
+    auto h = ind_buf.adopt(std::move(indices));
+    return {h.index, h.generation};
+}
+
+rst::ind_buf_id rst::rasterizer::borrow_indices(buffer_view<Eigen::Vector3i> indices)
+{
+    auto h = ind_buf.borrow(indices);
+    return {h.index, h.generation};
+}
 
-    return {id};
+void rst::rasterizer::update_indices(ind_buf_id id, std::vector<Eigen::Vector3i> indices)
+{
+    ind_buf.update(handle(id), std::move(indices));
 }
 
-rst::ind_buf_id rst::rasterizer::load_indices(const std::vector<Eigen::Vector3i> &indices)
+void rst::rasterizer::update_indices(ind_buf_id id, buffer_view<Eigen::Vector3i> indices)
 {
-    auto id = get_next_id();
-    ind_buf.emplace(id, indices);
+    ind_buf.update(handle(id), indices);
+}
 
-    return {id};
+rst::col_buf_id rst::rasterizer::load_colors(std::vector<Eigen::Vector3f> cols)
+{
+    auto h = col_buf.adopt(std::move(cols));
+    return {h.index, h.generation};
 }
 
-rst::col_buf_id rst::rasterizer::load_colors(const std::vector<Eigen::Vector3f> &cols)
+rst::col_buf_id rst::rasterizer::load_normals(std::vector<Eigen::Vector3f> normals)
 {
-    auto id = get_next_id();
-    col_buf.emplace(id, cols);
+    auto h = nor_buf.adopt(std::move(normals));
+
+    normal_id = h;
 
-    return {id};
+    return {h.index, h.generation};
 }
 
-rst::col_buf_id rst::rasterizer::load_normals(const std::vector<Eigen::Vector3f>& normals)
+rst::tex_buf_id rst::rasterizer::load_texcoords(std::vector<Eigen::Vector2f> texcoords)
 {
-    auto id = get_next_id();
-    nor_buf.emplace(id, normals);
+    auto h = tex_buf.adopt(std::move(texcoords));
 
-    normal_id = id;
+    texcoord_id = h;
 
-    return {id};
+    return {h.index, h.generation};
 }
 
+rst::vtx_buf_id rst::rasterizer::load_vertices(std::vector<vertex> vertices)
+{
+    auto h = vtx_buf.adopt(std::move(vertices));
+    auto view = vtx_buf.get(h);
+    set_bounds(vtx_bounds, h.index, view.empty() ? nullptr : view[0].position.data(), view.size, sizeof(vertex) / sizeof(float));
+    return {h.index, h.generation};
+}
+
+rst::vtx_buf_id rst::rasterizer::borrow_vertices(buffer_view<vertex> vertices)
+{
+    auto h = vtx_buf.borrow(vertices);
+    set_bounds(vtx_bounds, h.index, vertices.empty() ? nullptr : vertices[0].position.data(), vertices.size, sizeof(vertex) / sizeof(float));
+    return {h.index, h.generation};
+}
+
+void rst::rasterizer::update_vertices(vtx_buf_id id, std::vector<vertex> vertices)
+{
+    vtx_buf.update(handle(id), std::move(vertices));
+    auto view = vtx_buf.get(handle(id));
+    set_bounds(vtx_bounds, id.vtx_id, view.empty() ? nullptr : view[0].position.data(), view.size, sizeof(vertex) / sizeof(float));
+}
+
+void rst::rasterizer::update_vertices(vtx_buf_id id, buffer_view<vertex> vertices)
+{
+    vtx_buf.update(handle(id), vertices);
+    set_bounds(vtx_bounds, id.vtx_id, vertices.empty() ? nullptr : vertices[0].position.data(), vertices.size, sizeof(vertex) / sizeof(float));
+}
+
+void rst::rasterizer::free(pos_buf_id id) { pos_buf.free(handle(id)); }
+void rst::rasterizer::free(ind_buf_id id) { ind_buf.free(handle(id)); }
+void rst::rasterizer::free(col_buf_id id) { col_buf.free(handle(id)); }
+void rst::rasterizer::free(vtx_buf_id id) { vtx_buf.free(handle(id)); }
+
 
 // Bresenham's line drawing algorithm
 void rst::rasterizer::draw_line(Eigen::Vector3f begin, Eigen::Vector3f end)
@@ -149,161 +244,314 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
     return Vector4f(v3.x(), v3.y(), v3.z(), w);
 }
 
-static bool insideTriangle(int x, int y, const Vector4f* _v){
-    Vector3f v[3];
-    for(int i=0;i<3;i++)
-        v[i] = {_v[i].x(),_v[i].y(), 1.0};
-    Vector3f f0,f1,f2;
-    f0 = v[1].cross(v[0]);
-    f1 = v[2].cross(v[1]);
-    f2 = v[0].cross(v[2]);
-    Vector3f p(x,y,1.);
-    if((p.dot(f0)*f0.dot(v[2])>0) && (p.dot(f1)*f1.dot(v[0])>0) && (p.dot(f2)*f2.dot(v[1])>0))
-        return true;
-    return false;
+void rst::rasterizer::setup_transforms()
+{
+    modelview = view * model;
+    mvp = projection * modelview;
+    // normals are directions, so only the upper 3x3 of the inverse transpose matters
+    normal_matrix = modelview.topLeftCorner<3, 3>().inverse().transpose();
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector4f* v){
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+// Homogeneous division and viewport transformation of one clip space vertex.
+Eigen::Vector4f rst::rasterizer::to_screen(const Eigen::Vector4f& clip) const
+{
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    // w is kept, it is the view space depth used for perspective correction
+    return {0.5f * width * (clip.x() / clip.w() + 1.0f),
+            0.5f * height * (clip.y() / clip.w() + 1.0f),
+            clip.z() / clip.w() * f1 + f2,
+            clip.w()};
+}
+
+void rst::rasterizer::transform_triangle(const Triangle& t, Triangle& newtri, std::array<Eigen::Vector3f, 3>& viewspace_pos)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        viewspace_pos[i] = (modelview * t.v[i]).head<3>();
+        //clip space coordinates, clip_triangle() takes them to the screen
+        newtri.v[i] = mvp * t.v[i];
+        //view space normal
+        newtri.normal[i] = normal_matrix * t.normal[i];
+        newtri.tex_coords[i] = t.tex_coords[i];
+    }
+    newtri.tex = t.tex;
+
+    newtri.setColor(0, 148,121.0,92.0);
+    newtri.setColor(1, 148,121.0,92.0);
+    newtri.setColor(2, 148,121.0,92.0);
 }
 
 void rst::rasterizer::draw(std::vector<Triangle *> &TriangleList) {
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+    setup_transforms();
+    draw_binned(TriangleList.size(), [&](int i, Triangle& tri, std::array<Eigen::Vector3f, 3>& view_pos) {
+        // Also pass view space vertice position
+        transform_triangle(*TriangleList[i], tri, view_pos);
+    }, [this](const fragment_shader_payload& payload) { return fragment_shader(payload); });
+}
 
-    Eigen::Matrix4f mvp = projection * view * model;
-    for (const auto& t:TriangleList)
-    {
-        Triangle newtri = *t;
-
-        std::array<Eigen::Vector4f, 3> mm {
-                (view * model * t->v[0]),
-                (view * model * t->v[1]),
-                (view * model * t->v[2])
-        };
-
-        std::array<Eigen::Vector3f, 3> viewspace_pos;
-
-        std::transform(mm.begin(), mm.end(), viewspace_pos.begin(), [](auto& v) {
-            return v.template head<3>();
-        });
-
-        Eigen::Vector4f v[] = {
-                mvp * t->v[0],
-                mvp * t->v[1],
-                mvp * t->v[2]
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec.x()/=vec.w();
-            vec.y()/=vec.w();
-            vec.z()/=vec.w();
-        }
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type)
+{
+    draw(pos_buffer, ind_buffer, col_buffer, type,
+         [this](const fragment_shader_payload& payload) { return fragment_shader(payload); });
+}
 
-        Eigen::Matrix4f inv_trans = (view * model).inverse().transpose();
-        Eigen::Vector4f n[] = {
-                inv_trans * to_vec4(t->normal[0], 0.0f),
-                inv_trans * to_vec4(t->normal[1], 0.0f),
-                inv_trans * to_vec4(t->normal[2], 0.0f)
-        };
+void rst::rasterizer::draw(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer, Primitive type)
+{
+    draw(vertex_buffer, ind_buffer, type,
+         [this](const fragment_shader_payload& payload) { return fragment_shader(payload); });
+}
 
-        //Viewport transformation
-        for (auto & vert : v)
+// Depth-only draw of n indexed triangles whose positions are stride floats apart.
+void rst::rasterizer::draw_depth(const float* positions, int n, int stride, buffer_view<Eigen::Vector3i> ind)
+{
+    transform_vertices(positions, nullptr, n, stride, true);
+    draw_binned(ind.size, [&](int k, Triangle& tri, std::array<Eigen::Vector3f, 3>& view_pos) {
+        for (int j = 0; j < 3; ++j)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            tri.v[j] = clip_verts.col(ind[k][j]);
+            view_pos[j].setZero(); // only carried through clipping
         }
+    }, detail::depth_only{});
+}
 
-        for (int i = 0; i < 3; ++i)
-        {
-            //screen space coordinates
-            newtri.setVertex(i, v[i]);
-        }
+void rst::rasterizer::draw_depth(pos_buf_id pos_buffer, ind_buf_id ind_buffer)
+{
+    auto pos = pos_buf.get(handle(pos_buffer));
+    auto ind = ind_buf.get(handle(ind_buffer));
+    if (pos.empty() || ind.empty())
+        return;
+
+    setup_transforms();
+    if (outside_frustum(pos_bounds[pos_buffer.pos_id]))
+        return;
+    draw_depth(pos[0].data(), pos.size, 3, ind);
+}
 
-        for (int i = 0; i < 3; ++i)
+void rst::rasterizer::draw_depth(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer)
+{
+    auto vtx = vtx_buf.get(handle(vertex_buffer));
+    auto ind = ind_buf.get(handle(ind_buffer));
+    if (vtx.empty() || ind.empty())
+        return;
+
+    setup_transforms();
+    if (outside_frustum(vtx_bounds[vertex_buffer.vtx_id]))
+        return;
+    draw_depth(vtx[0].position.data(), vtx.size, sizeof(vertex) / sizeof(float), ind);
+}
+
+// Vertex stage of the indexed draws: every unique vertex is transformed exactly once,
+// in blocks of columns so Eigen can batch the matrix products, into the post-transform
+// cache. Triangles then only gather. Positions stay in clip space, the homogeneous
+// division waits for clipping. Separate arrays have a stride of 3 floats, interleaved
+// vertices the size of a vertex.
+void rst::rasterizer::transform_vertices(const float* positions, const float* normals, int n, int stride, bool depth_only)
+{
+    using strided = Eigen::Map<const Eigen::Matrix3Xf, 0, Eigen::OuterStride<>>;
+
+    clip_verts.resize(4, n);
+    view_verts.resize(3, depth_only ? 0 : n);
+    view_normals.resize(3, normals && !depth_only ? n : 0);
+
+    constexpr int block = 4096;
+    detail::parallel_for((n + block - 1) / block, num_threads, [&](int b) {
+        int first = b * block, count = std::min(block, n - first);
+        strided pos(positions + (size_t)first * stride, 3, count, Eigen::OuterStride<>(stride));
+
+        clip_verts.middleCols(first, count) = (mvp.leftCols<3>() * pos).colwise() + mvp.col(3);
+        if (depth_only)
+            return;
+        view_verts.middleCols(first, count) = (modelview.topLeftCorner<3, 3>() * pos).colwise() + modelview.col(3).head<3>();
+        if (normals)
         {
-            //view space normal
-            newtri.setNormal(i, n[i].head<3>());
+            strided nor(normals + (size_t)first * stride, 3, count, Eigen::OuterStride<>(stride));
+            view_normals.middleCols(first, count) = normal_matrix * nor;
         }
+    });
+}
 
-        newtri.setColor(0, 148,121.0,92.0);
-        newtri.setColor(1, 148,121.0,92.0);
-        newtri.setColor(2, 148,121.0,92.0);
-
-        // Also pass view space vertice position
-        rasterize_triangle(newtri, viewspace_pos);
+// Per-mesh frustum culling: true when the bounding sphere (center, radius), transformed
+// by modelview, lies entirely outside one plane of the view frustum. The planes follow
+// from the projection matrix, a view space point is inside when w +- x, w +- y and
+// w +- z are all non-negative in clip space.
+bool rst::rasterizer::outside_frustum(const Eigen::Vector4f& sphere) const
+{
+    Eigen::Matrix3f linear = modelview.topLeftCorner<3, 3>();
+    Eigen::Vector4f center;
+    center << linear * sphere.head<3>() + modelview.col(3).head<3>(), 1;
+    // the longest transformed axis bounds the radius under any scaling
+    float radius = sphere.w() * linear.colwise().norm().maxCoeff();
 
+    for (int i = 0; i < 3; ++i)
+    {
+        for (float sign : {1.0f, -1.0f})
+        {
+            Eigen::Vector4f plane = projection.row(3) + sign * projection.row(i);
+            if (plane.dot(center) < -radius * plane.head<3>().norm())
+                return true;
+        }
     }
+    return false;
 }
 
-static Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3, float weight)
+namespace
 {
-    return (alpha * vert1 + beta * vert2 + gamma * vert3) / weight;
-}
+    // A polygon vertex during clipping: the clip space position and every attribute
+    // interpolated over the triangle, all of which are linear in clip space.
+    struct clip_vertex
+    {
+        Eigen::Vector4f pos;
+        Eigen::Vector3f color, normal, view_pos;
+        Eigen::Vector2f tex_coords;
+    };
 
-static Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3, float weight)
-{
-    auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
-    auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+    clip_vertex lerp(const clip_vertex& a, const clip_vertex& b, float t)
+    {
+        return {a.pos + t * (b.pos - a.pos), a.color + t * (b.color - a.color),
+                a.normal + t * (b.normal - a.normal), a.view_pos + t * (b.view_pos - a.view_pos),
+                a.tex_coords + t * (b.tex_coords - a.tex_coords)};
+    }
 
-    u /= weight;
-    v /= weight;
+    // Sutherland-Hodgman: clips the convex polygon in[0, n) to the half space where the
+    // plane distance d(pos) >= 0, writing at most n + 1 vertices to out. Returns their count.
+    template <typename Distance>
+    int clip_polygon(const clip_vertex* in, int n, clip_vertex* out, Distance d)
+    {
+        int m = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const clip_vertex& a = in[i];
+            const clip_vertex& b = in[(i + 1) % n];
+            float da = d(a.pos), db = d(b.pos);
+            if (da >= 0)
+                out[m++] = a;
+            if ((da >= 0) != (db >= 0))
+                out[m++] = lerp(a, b, da / (da - db));
+        }
+        return m;
+    }
 
-    return Eigen::Vector2f(u, v);
+    // outcode bits of a clip space vertex
+    enum : int
+    {
+        outside_left = 1, outside_right = 2, outside_bottom = 4, outside_top = 8,
+        outside_near = 16, outside_far = 32,
+        // beyond the guard band, or in front of the near plane: needs clipping
+        clip_left = 64, clip_right = 128, clip_bottom = 256, clip_top = 512,
+        clip_any = outside_near | clip_left | clip_right | clip_bottom | clip_top
+    };
+
+    int outcode(const Eigen::Vector4f& p, float guard_band)
+    {
+        float w = p.w(), gw = guard_band * p.w();
+        return (p.x() < -w) * outside_left | (p.x() > w) * outside_right |
+               (p.y() < -w) * outside_bottom | (p.y() > w) * outside_top |
+               (p.z() < -w) * outside_near | (p.z() > w) * outside_far |
+               (p.x() < -gw) * clip_left | (p.x() > gw) * clip_right |
+               (p.y() < -gw) * clip_bottom | (p.y() > gw) * clip_top;
+    }
 }
 
-//Screen space rasterization
-void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos) 
+void rst::rasterizer::clip_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& t_view_pos,
+                                   std::vector<Triangle>& tris, std::vector<std::array<Eigen::Vector3f, 3>>& view_pos) const
 {
-    // TODO: From your HW3, get the triangle rasterization code.
-    // First, find out the bounding box of the triangle
-    float aabb_min_x, aabb_min_y, aabb_max_x, aabb_max_y;
-    aabb_min_x = std::min({t.v[0].x(), t.v[1].x(), t.v[2].x()});
-    aabb_min_y = std::min({t.v[0].y(), t.v[1].y(), t.v[2].y()});
-    aabb_max_x = std::max({t.v[0].x(), t.v[1].x(), t.v[2].x()});
-    aabb_max_y = std::max({t.v[0].y(), t.v[1].y(), t.v[2].y()});
-    auto v = t.v;
-    for (int x=aabb_min_x; x<=aabb_max_x; ++x){
-        for (int y=aabb_min_y; y<=aabb_max_y; ++y){
-            if (!insideTriangle(x, y, v)) continue;
-            // Inside your rasterization loop:
-            //    * v[i].w() is the vertex view space depth value z.
-            //    * Z is interpolated view space depth for the current pixel
-            //    * zp is depth between zNear and zFar, used for z-buffering
-            auto [alpha, beta, gamma] = computeBarycentric2D(x, y, v);
-            float Z = 1.0 / (alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-            float zp = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-
-            zp *= Z;
+    int codes[3] = {outcode(t.v[0], guard_band), outcode(t.v[1], guard_band), outcode(t.v[2], guard_band)};
+    // all three vertices outside the same frustum plane
+    if (codes[0] & codes[1] & codes[2])
+        return;
+
+    // twice the signed screen space area of the polygon p[0, n), positive when counter-clockwise
+    auto culled = [&](const Eigen::Vector4f* p, int n) {
+        float area = 0;
+        for (int i = 0; i < n; ++i)
+        {
+            const Eigen::Vector4f& a = p[i];
+            const Eigen::Vector4f& b = p[(i + 1) % n];
+            area += a.x() * b.y() - b.x() * a.y();
+        }
+        return (cull_mode == Cull::Back && area <= 0) || (cull_mode == Cull::Front && area >= 0);
+    };
 
-            int buf_index = get_index(x, y);
-            if (zp >= depth_buf[buf_index]) continue;
-            // TODO: Interpolate the attributes:
-            // auto interpolated_color
-            // auto interpolated_normal
-            // auto interpolated_texcoords
-            // auto interpolated_shadingcoords
-            auto interpolated_color = interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2], Z);
-            auto interpolated_normal = interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2], Z);
-            auto interpolated_texcoords = interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], Z);
-            auto interpolated_shadingcoords = interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2], Z);
+    if (!((codes[0] | codes[1] | codes[2]) & clip_any))
+    {
+        // the common case: nothing to clip
+        Triangle screen = t;
+        for (int i = 0; i < 3; ++i)
+            screen.v[i] = to_screen(t.v[i]);
+        if (culled(screen.v, 3))
+            return;
+        tris.push_back(screen);
+        view_pos.push_back(t_view_pos);
+        return;
+    }
 
-            // Use: fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-            // Use: payload.view_pos = interpolated_shadingcoords;
-            // Use: Instead of passing the triangle's color directly to the frame buffer, pass the color to the shaders first to get the final color;
-            // Use: auto pixel_color = fragment_shader(payload);
+    // 3 vertices plus at most one more per clip plane
+    clip_vertex poly[8], scratch[8];
+    for (int i = 0; i < 3; ++i)
+        poly[i] = {t.v[i], t.color[i], t.normal[i], t_view_pos[i], t.tex_coords[i]};
+    int n = 3;
+    auto clip = [&](int code, auto distance) {
+        if (n == 0 || !((codes[0] | codes[1] | codes[2]) & code))
+            return;
+        n = clip_polygon(poly, n, scratch, distance);
+        std::copy(scratch, scratch + n, poly);
+    };
+    clip(outside_near, [](const Eigen::Vector4f& p) { return p.z() + p.w(); });
+    clip(clip_left, [](const Eigen::Vector4f& p) { return p.x() + guard_band * p.w(); });
+    clip(clip_right, [](const Eigen::Vector4f& p) { return guard_band * p.w() - p.x(); });
+    clip(clip_bottom, [](const Eigen::Vector4f& p) { return p.y() + guard_band * p.w(); });
+    clip(clip_top, [](const Eigen::Vector4f& p) { return guard_band * p.w() - p.y(); });
+    if (n < 3)
+        return;
+
+    Eigen::Vector4f screen[8];
+    for (int i = 0; i < n; ++i)
+        screen[i] = to_screen(poly[i].pos);
+    if (culled(screen, n))
+        return;
+
+    // the clipped polygon is convex, so a fan from its first vertex covers it
+    for (int i = 1; i + 1 < n; ++i)
+    {
+        Triangle tri;
+        std::array<Eigen::Vector3f, 3> tri_view_pos;
+        int k[3] = {0, i, i + 1};
+        for (int j = 0; j < 3; ++j)
+        {
+            const clip_vertex& cv = poly[k[j]];
+            tri.v[j] = screen[k[j]];
+            tri.color[j] = cv.color;
+            tri.normal[j] = cv.normal;
+            tri.tex_coords[j] = cv.tex_coords;
+            tri_view_pos[j] = cv.view_pos;
+        }
+        tri.tex = t.tex;
+        tris.push_back(tri);
+        view_pos.push_back(tri_view_pos);
+    }
+}
 
-            fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, texture ? &*texture : nullptr);
-            payload.view_pos = interpolated_shadingcoords;
-            auto pixel_color = fragment_shader(payload);
-            set_pixel(Eigen::Vector2i(x, y), pixel_color);
+// Recomputes the depth range of the hierarchical depth tile containing pixel (x, y).
+void rst::rasterizer::update_depth_tile(int x, int y)
+{
+    int x0 = x - x % detail::raster_tile, x1 = std::min(x0 + detail::raster_tile, width);
+    int y0 = y - y % detail::raster_tile, y1 = std::min(y0 + detail::raster_tile, height);
+    float zmin = std::numeric_limits<float>::infinity(), zmax = -zmin;
+    for (int j = y0; j < y1; ++j)
+    {
+        const float* row = &depth_buf[get_index(0, j)];
+        for (int i = x0; i < x1; ++i)
+        {
+            zmin = std::min(zmin, row[i]);
+            zmax = std::max(zmax, row[i]);
         }
     }
+    int tile = (y / detail::raster_tile) * depth_tiles_x + x / detail::raster_tile;
+    depth_tile_min[tile] = zmin;
+    depth_tile_max[tile] = zmax;
 }
 
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
@@ -325,32 +573,33 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(frame_buf.begin(), frame_buf.end(), 0);
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(depth_tile_min.begin(), depth_tile_min.end(), std::numeric_limits<float>::infinity());
+        std::fill(depth_tile_max.begin(), depth_tile_max.end(), std::numeric_limits<float>::infinity());
     }
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
-    frame_buf.resize(w * h);
-    depth_buf.resize(w * h);
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+    frame_buf.resize(3 * w * h);
+    depth_buf.resize(w * h, std::numeric_limits<float>::infinity());
+    depth_tiles_x = (w + detail::raster_tile - 1) / detail::raster_tile;
+    depth_tile_min.resize(depth_tiles_x * ((h + detail::raster_tile - 1) / detail::raster_tile), std::numeric_limits<float>::infinity());
+    depth_tile_max.resize(depth_tile_min.size(), std::numeric_limits<float>::infinity());
 
     texture = std::nullopt;
 }
 
-int rst::rasterizer::get_index(int x, int y)
-{
-    return (height-y)*width + x;
-}
-
 void rst::rasterizer::set_pixel(const Vector2i &point, const Eigen::Vector3f &color)
 {
     //old index: auto ind = point.y() + point.x() * width;
-    int ind = (height-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    int ind = (height-1-point.y())*width + point.x();
+    store_color(ind, color);
 }
 
 void rst::rasterizer::set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader)
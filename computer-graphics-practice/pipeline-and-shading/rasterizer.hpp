@@ -7,7 +7,9 @@
 #include <Eigen/Eigen>
 #include <optional>
 #include <algorithm>
+#include <cmath>
 #include "global.hpp"
+#include "buffer_pool.hpp"
 #include "Shader.hpp"
 #include "Triangle.hpp"
 
@@ -45,32 +47,94 @@ namespace rst
     struct pos_buf_id
     {
         int pos_id = 0;
+        unsigned generation = 0;
     };
 
     struct ind_buf_id
     {
         int ind_id = 0;
+        unsigned generation = 0;
     };
 
     struct col_buf_id
     {
         int col_id = 0;
+        unsigned generation = 0;
+    };
+
+    struct tex_buf_id
+    {
+        int tex_id = 0;
+        unsigned generation = 0;
+    };
+
+    struct vtx_buf_id
+    {
+        int vtx_id = 0;
+        unsigned generation = 0;
+    };
+
+    // Interleaved vertex: everything the vertex stage and the assembly read for one vertex
+    // lies in one 44-byte record instead of four separate arrays.
+    struct vertex
+    {
+        Eigen::Vector3f position;
+        Eigen::Vector3f normal;
+        Eigen::Vector3f color;
+        Eigen::Vector2f tex_coords;
+    };
+    static_assert(sizeof(vertex) == 11 * sizeof(float), "vertex must be tightly packed floats");
+
+    // Which triangles the primitive assembly discards by their screen space winding.
+    // Counter-clockwise, seen with y pointing up, is front facing.
+    enum class Cull
+    {
+        None,
+        Back,
+        Front
     };
 
     class rasterizer
     {
     public:
         rasterizer(int w, int h);
-        pos_buf_id load_positions(const std::vector<Eigen::Vector3f>& positions);
-        ind_buf_id load_indices(const std::vector<Eigen::Vector3i>& indices);
-        col_buf_id load_colors(const std::vector<Eigen::Vector3f>& colors);
-        col_buf_id load_normals(const std::vector<Eigen::Vector3f>& normals);
+        // The load functions take over the vector: pass it with std::move to skip the copy.
+        pos_buf_id load_positions(std::vector<Eigen::Vector3f> positions);
+        ind_buf_id load_indices(std::vector<Eigen::Vector3i> indices);
+        col_buf_id load_colors(std::vector<Eigen::Vector3f> colors);
+        col_buf_id load_normals(std::vector<Eigen::Vector3f> normals);
+        tex_buf_id load_texcoords(std::vector<Eigen::Vector2f> texcoords);
+        vtx_buf_id load_vertices(std::vector<vertex> vertices);
+
+        // Borrowed buffers read the caller's memory in place; it has to stay alive and
+        // unchanged while draws use it, until the buffer is updated or freed.
+        pos_buf_id borrow_positions(buffer_view<Eigen::Vector3f> positions);
+        ind_buf_id borrow_indices(buffer_view<Eigen::Vector3i> indices);
+        vtx_buf_id borrow_vertices(buffer_view<vertex> vertices);
+
+        // New contents for an existing buffer, adopted or borrowed like above. Geometry
+        // that changes every frame keeps its id.
+        void update_positions(pos_buf_id id, std::vector<Eigen::Vector3f> positions);
+        void update_positions(pos_buf_id id, buffer_view<Eigen::Vector3f> positions);
+        void update_indices(ind_buf_id id, std::vector<Eigen::Vector3i> indices);
+        void update_indices(ind_buf_id id, buffer_view<Eigen::Vector3i> indices);
+        void update_vertices(vtx_buf_id id, std::vector<vertex> vertices);
+        void update_vertices(vtx_buf_id id, buffer_view<vertex> vertices);
+
+        // Freed ids are invalid: using one throws, even after its slot has been reused.
+        void free(pos_buf_id id);
+        void free(ind_buf_id id);
+        void free(col_buf_id id);
+        void free(vtx_buf_id id);
 
         void set_model(const Eigen::Matrix4f& m);
         void set_view(const Eigen::Matrix4f& v);
         void set_projection(const Eigen::Matrix4f& p);
 
-        void set_texture(Texture tex) { texture = tex; }
+        void set_texture(Texture tex) { texture = std::move(tex); }
+
+        // back-face culling mode of all later draws, Cull::None by default
+        void set_cull_mode(Cull mode) { cull_mode = mode; }
 
         void set_vertex_shader(std::function<Eigen::Vector3f(vertex_shader_payload)> vert_shader);
         void set_fragment_shader(std::function<Eigen::Vector3f(fragment_shader_payload)> frag_shader);
@@ -79,15 +143,63 @@ namespace rst
 
         void clear(Buffers buff);
 
+        // indexed draw, uses the last loaded normals and texture coordinates
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type);
+        // Same, shading with shader(const fragment_shader_payload&) -> Eigen::Vector3f instead
+        // of the fragment shader set by set_fragment_shader(). The raster loop is instantiated
+        // for the shader type, so the call is inlined; per-draw constants such as lights and
+        // material coefficients belong in the shader object rather than in every invocation.
+        template <typename FragmentShader>
+        void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type,
+                  const FragmentShader& shader);
+        // indexed draw of interleaved vertices
+        void draw(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer, Primitive type);
+        template <typename FragmentShader>
+        void draw(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer, Primitive type, const FragmentShader& shader);
         void draw(std::vector<Triangle *> &TriangleList);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // Depth-only draws: only the depth buffer is tested and written, no attribute is
+        // interpolated and nothing is shaded. The pass behind shadow maps and depth prepasses.
+        void draw_depth(pos_buf_id pos_buffer, ind_buf_id ind_buffer);
+        void draw_depth(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer);
+        // depth of every pixel, rows top to bottom
+        const std::vector<float>& depth_buffer() const { return depth_buf; }
+
+        // 8-bit BGR pixels, top row first: the layout of a CV_8UC3 image, so the frame
+        // can be encoded or shown without a conversion pass
+        std::vector<u08>& frame_buffer() { return frame_buf; }
+
+        // worker threads used by draw(), defaults to the hardware concurrency
+        void set_num_threads(int n) { num_threads = std::max(1, n); }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
-        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos);
+        void setup_transforms();
+        Eigen::Vector4f to_screen(const Eigen::Vector4f& clip) const;
+        void transform_triangle(const Triangle& t, Triangle& newtri, std::array<Eigen::Vector3f, 3>& viewspace_pos);
+
+        // n vertices whose positions (and normals, if not null) are stride floats apart;
+        // with depth_only set only the clip space positions are computed
+        void transform_vertices(const float* positions, const float* normals, int n, int stride, bool depth_only = false);
+        bool outside_frustum(const Eigen::Vector4f& sphere) const;
+        // Primitive assembly of one triangle with clip space vertices: culls it and clips
+        // it against the near plane and the guard band, then appends the resulting screen
+        // space triangles (none, one, or a fan of several) to tris and view_pos.
+        void clip_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& t_view_pos,
+                           std::vector<Triangle>& tris, std::vector<std::array<Eigen::Vector3f, 3>>& view_pos) const;
+
+        void draw_depth(const float* positions, int n, int stride, buffer_view<Eigen::Vector3i> ind);
+
+        template <typename Assemble, typename FragmentShader>
+        void draw_binned(int n, Assemble&& assemble, const FragmentShader& shader);
+
+        // rasterizes the part of t inside the pixel rectangle [clip_min, clip_max]
+        template <typename FragmentShader>
+        void rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& world_pos,
+                                int clip_min_x, int clip_min_y, int clip_max_x, int clip_max_y,
+                                const FragmentShader& shader);
+        void update_depth_tile(int x, int y);
 
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
@@ -96,25 +208,71 @@ namespace rst
         Eigen::Matrix4f view;
         Eigen::Matrix4f projection;
 
-        int normal_id = -1;
+        // per-draw transforms, computed once by setup_transforms()
+        Eigen::Matrix4f modelview;
+        Eigen::Matrix4f mvp;
+        Eigen::Matrix3f normal_matrix;
+
+        // the last loaded normals and texture coordinates
+        std::optional<buffer_handle> normal_id;
+        std::optional<buffer_handle> texcoord_id;
+
+        buffer_pool<Eigen::Vector3f> pos_buf;
+        buffer_pool<Eigen::Vector3i> ind_buf;
+        buffer_pool<Eigen::Vector3f> col_buf;
+        buffer_pool<Eigen::Vector3f> nor_buf;
+        buffer_pool<Eigen::Vector2f> tex_buf;
+        buffer_pool<vertex> vtx_buf;
+        // bounding spheres of the position and vertex buffers by slot: center and radius in w
+        std::vector<Eigen::Vector4f> pos_bounds;
+        std::vector<Eigen::Vector4f> vtx_bounds;
+        static void set_bounds(std::vector<Eigen::Vector4f>& bounds, int slot, const float* positions, int n, int stride);
+
+        static buffer_handle handle(pos_buf_id id) { return {id.pos_id, id.generation}; }
+        static buffer_handle handle(ind_buf_id id) { return {id.ind_id, id.generation}; }
+        static buffer_handle handle(col_buf_id id) { return {id.col_id, id.generation}; }
+        static buffer_handle handle(vtx_buf_id id) { return {id.vtx_id, id.generation}; }
 
-        std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
-        std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-        std::map<int, std::vector<Eigen::Vector3f>> nor_buf;
+        // post-transform vertex cache of the indexed draw, one column per vertex
+        Eigen::Matrix4Xf clip_verts;
+        Eigen::Matrix3Xf view_verts;
+        Eigen::Matrix3Xf view_normals;
 
         std::optional<Texture> texture;
+        Cull cull_mode = Cull::None;
+
+        // Triangles are clipped against x, y = +-guard_band * w instead of the viewport
+        // edges: the raster stage clamps bounding boxes to the screen anyway, so only
+        // triangles reaching far enough to hurt the precision of the edge functions pay
+        // for clipping. The near plane is always clipped against.
+        static constexpr float guard_band = 8;
 
         std::function<Eigen::Vector3f(fragment_shader_payload)> fragment_shader;
         std::function<Eigen::Vector3f(vertex_shader_payload)> vertex_shader;
 
-        std::vector<Eigen::Vector3f> frame_buf;
+        std::vector<u08> frame_buf;
+        // packs an RGB color in [0, 255] into pixel ind of frame_buf
+        void store_color(int ind, const Eigen::Vector3f& color)
+        {
+            u08* pixel = &frame_buf[3 * ind];
+            for (int c = 0; c < 3; ++c)
+                pixel[2 - c] = (u08)std::clamp(std::lrint(color[c]), 0L, 255L);
+        }
         std::vector<float> depth_buf;
-        int get_index(int x, int y);
+        // coarse depth hierarchy: nearest and farthest depth of every 8x8 pixel tile
+        std::vector<float> depth_tile_min;
+        std::vector<float> depth_tile_max;
+        int depth_tiles_x = 0;
+        int get_index(int x, int y) const { return (height - 1 - y) * width + x; }
 
         int width, height;
 
-        int next_id = 0;
-        int get_next_id() { return next_id++; }
+        // side of the screen tiles triangles are binned into, a multiple of the depth
+        // tile size so no two threads ever update the same depth tile
+        static constexpr int bin_size = 64;
+        int num_threads = 1;
+
     };
 }
+
+#include "rasterizer_impl.hpp"
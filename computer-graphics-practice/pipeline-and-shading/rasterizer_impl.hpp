@@ -0,0 +1,471 @@
+//
+// Template parts of the rasterizer: the raster loop is instantiated per fragment
+// shader type so the shader inlines into it. Included by rasterizer.hpp.
+//
+
+#pragma once
+
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <type_traits>
+
+namespace rst::detail
+{
+    // Edge functions of a screen-space triangle, E_i(x, y) = A_i * x + B_i * y + C_i,
+    // where E_i belongs to the edge opposite vertex i. Dividing by E_i(v_i), which is
+    // twice the signed area, gives the barycentric coordinates directly, so a pixel is
+    // inside when all three are >= 0. Clockwise triangles get their signs flipped.
+    // x and y are taken relative to the corner (min_x, min_y) of the bounding box: with
+    // absolute screen coordinates C_i is in the order of x * y and small triangles lose
+    // most of the precision of their barycentrics to cancellation.
+    struct edge_setup
+    {
+        float A[3], B[3], C[3];
+        float inv_area;
+        int min_x, min_y, max_x, max_y; // bounding box clamped to the clip rectangle
+    };
+
+    // size of the screen blocks tested against the edge functions as a whole
+    inline constexpr int raster_tile = 8;
+
+    // Sets up the edge functions of v and clamps its bounding box to the given pixel
+    // rectangle. Returns false for degenerate triangles or an empty box.
+    inline bool setup_triangle(const Vector4f* v, int clip_min_x, int clip_min_y, int clip_max_x, int clip_max_y, edge_setup& s)
+    {
+        s.min_x = std::max(clip_min_x, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()})));
+        s.min_y = std::max(clip_min_y, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()})));
+        s.max_x = std::min(clip_max_x, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()})));
+        s.max_y = std::min(clip_max_y, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()})));
+        if (s.min_x > s.max_x || s.min_y > s.max_y)
+            return false;
+
+        float x[3], y[3];
+        for (int i = 0; i < 3; ++i)
+        {
+            x[i] = v[i].x() - s.min_x;
+            y[i] = v[i].y() - s.min_y;
+        }
+        for (int i = 0; i < 3; ++i)
+        {
+            int p = (i + 1) % 3, q = (i + 2) % 3;
+            s.A[i] = y[p] - y[q];
+            s.B[i] = x[q] - x[p];
+            s.C[i] = x[p] * y[q] - x[q] * y[p];
+        }
+        float area = s.A[0] * x[0] + s.B[0] * y[0] + s.C[0];
+        if (area == 0 || !std::isfinite(area))
+            return false;
+        if (area < 0)
+        {
+            for (int i = 0; i < 3; ++i)
+            {
+                s.A[i] = -s.A[i];
+                s.B[i] = -s.B[i];
+                s.C[i] = -s.C[i];
+            }
+            area = -area;
+        }
+        s.inv_area = 1.0f / area;
+        return true;
+    }
+
+    // Calls block(x0, y0, x1, y1, inside) for every raster_tile block of the bounding box
+    // the triangle may cover. Blocks are aligned to the screen grid (and clamped to the
+    // box), so each one lies inside a single hierarchical depth tile. A block is skipped
+    // when one edge function is negative at all of its corners; inside is set when all
+    // three are non-negative at all corners, i.e. the block is fully covered.
+    template <typename Block>
+    void for_each_covered_block(const edge_setup& s, Block&& block)
+    {
+        for (int ty = s.min_y - s.min_y % raster_tile; ty <= s.max_y; ty += raster_tile)
+        {
+            int y0 = std::max(ty, s.min_y), y1 = std::min(ty + raster_tile - 1, s.max_y);
+            for (int tx = s.min_x - s.min_x % raster_tile; tx <= s.max_x; tx += raster_tile)
+            {
+                int x0 = std::max(tx, s.min_x), x1 = std::min(tx + raster_tile - 1, s.max_x);
+
+                // block corners relative to the edge function origin
+                int rx0 = x0 - s.min_x, ry0 = y0 - s.min_y, rx1 = x1 - s.min_x, ry1 = y1 - s.min_y;
+                bool outside = false, inside = true;
+                for (int i = 0; i < 3; ++i)
+                {
+                    // E is linear, so its extremes over the block are at the corners
+                    float e_max = s.C[i] + s.A[i] * (s.A[i] > 0 ? rx1 : rx0) + s.B[i] * (s.B[i] > 0 ? ry1 : ry0);
+                    float e_min = s.C[i] + s.A[i] * (s.A[i] > 0 ? rx0 : rx1) + s.B[i] * (s.B[i] > 0 ? ry0 : ry1);
+                    outside |= e_max < 0;
+                    inside &= e_min >= 0;
+                }
+                if (!outside)
+                    block(x0, y0, x1, y1, inside);
+            }
+        }
+    }
+
+    // Calls visit(x, y, alpha, beta, gamma) for every covered pixel of a block, stepping
+    // the edge functions with adds. Fully covered blocks skip the per-pixel test.
+    template <typename Visit>
+    void for_each_pixel_in_block(const edge_setup& s, int x0, int y0, int x1, int y1, bool inside, Visit&& visit)
+    {
+        float e_row[3];
+        for (int i = 0; i < 3; ++i)
+            e_row[i] = s.A[i] * (x0 - s.min_x) + s.B[i] * (y0 - s.min_y) + s.C[i];
+
+        for (int y = y0; y <= y1; ++y)
+        {
+            float e0 = e_row[0], e1 = e_row[1], e2 = e_row[2];
+            for (int x = x0; x <= x1; ++x)
+            {
+                if (inside || (e0 >= 0 && e1 >= 0 && e2 >= 0))
+                    visit(x, y, e0 * s.inv_area, e1 * s.inv_area, e2 * s.inv_area);
+                e0 += s.A[0];
+                e1 += s.A[1];
+                e2 += s.A[2];
+            }
+            e_row[0] += s.B[0];
+            e_row[1] += s.B[1];
+            e_row[2] += s.B[2];
+        }
+    }
+
+    using lanes = fragment_shader_batch::lanes;
+    using lane_mask = Eigen::Array<bool, fragment_shader_batch::size, 1>;
+
+    // pixel offsets of the lanes of a fragment_shader_batch inside its 4x2 block
+    inline const lanes group_dx = (lanes() << 0, 1, 2, 3, 0, 1, 2, 3).finished();
+    inline const lanes group_dy = (lanes() << 0, 0, 0, 0, 1, 1, 1, 1).finished();
+
+    // Calls visit(gx, gy, e, covered) for every 4x2 pixel group of a block that has a
+    // covered pixel, with the edge functions e[3] and the coverage of all eight lanes.
+    // Groups are aligned to the screen grid so their quads are the same for every
+    // triangle; lanes outside the block are never covered.
+    template <typename Visit>
+    void for_each_group_in_block(const edge_setup& s, int x0, int y0, int x1, int y1, Visit&& visit)
+    {
+        for (int gy = y0 - y0 % 2; gy <= y1; gy += 2)
+        {
+            for (int gx = x0 - x0 % 4; gx <= x1; gx += 4)
+            {
+                lanes px = group_dx + gx, py = group_dy + gy;
+                lanes e[3];
+                for (int i = 0; i < 3; ++i)
+                    e[i] = s.A[i] * (px - s.min_x) + s.B[i] * (py - s.min_y) + s.C[i];
+                lane_mask covered = e[0] >= 0 && e[1] >= 0 && e[2] >= 0 &&
+                                    px >= x0 && px <= x1 && py >= y0 && py <= y1;
+                if (covered.any())
+                    visit(gx, gy, e, covered);
+            }
+        }
+    }
+
+    // True when the shader takes whole fragment_shader_batch groups.
+    template <typename FragmentShader>
+    inline constexpr bool is_batch_shader = std::is_invocable_v<const FragmentShader&, const fragment_shader_batch&>;
+
+    // Stands in for the fragment shader of depth-only draws: the raster loop only tests
+    // and writes depth, without interpolating attributes or touching the frame buffer.
+    struct depth_only {};
+
+    template <typename FragmentShader>
+    inline constexpr bool is_depth_only = std::is_same_v<FragmentShader, depth_only>;
+
+    // Runs job(i) for i in [0, n) on up to num_threads threads.
+    template <typename Job>
+    void parallel_for(int n, int num_threads, Job&& job)
+    {
+        std::atomic<int> next{0};
+        auto worker = [&] {
+            for (int i = next++; i < n; i = next++)
+                job(i);
+        };
+        std::vector<std::thread> threads;
+        for (int k = 1; k < std::min(n, num_threads); ++k)
+            threads.emplace_back(worker);
+        worker();
+        for (auto& th : threads)
+            th.join();
+    }
+
+    inline Eigen::Vector3f interpolate(float alpha, float beta, float gamma, const Eigen::Vector3f& vert1, const Eigen::Vector3f& vert2, const Eigen::Vector3f& vert3)
+    {
+        return alpha * vert1 + beta * vert2 + gamma * vert3;
+    }
+
+    inline Eigen::Vector2f interpolate(float alpha, float beta, float gamma, const Eigen::Vector2f& vert1, const Eigen::Vector2f& vert2, const Eigen::Vector2f& vert3)
+    {
+        auto u = (alpha * vert1[0] + beta * vert2[0] + gamma * vert3[0]);
+        auto v = (alpha * vert1[1] + beta * vert2[1] + gamma * vert3[1]);
+
+        return Eigen::Vector2f(u, v);
+    }
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type,
+                           const FragmentShader& shader)
+{
+    if (type != rst::Primitive::Triangle)
+    {
+        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    }
+    auto pos = pos_buf.get(handle(pos_buffer));
+    auto ind = ind_buf.get(handle(ind_buffer));
+    auto col = col_buf.get(handle(col_buffer));
+    auto nor = normal_id ? nor_buf.get(*normal_id) : buffer_view<Eigen::Vector3f>();
+    auto tex = texcoord_id ? tex_buf.get(*texcoord_id) : buffer_view<Eigen::Vector2f>();
+    if (pos.empty() || ind.empty())
+        return;
+
+    setup_transforms();
+    if (outside_frustum(pos_bounds[pos_buffer.pos_id]))
+        return;
+    transform_vertices(pos[0].data(), nor.empty() ? nullptr : nor[0].data(), pos.size, 3);
+
+    draw_binned(ind.size, [&](int k, Triangle& tri, std::array<Eigen::Vector3f, 3>& view_pos) {
+        const Eigen::Vector3i& i = ind[k];
+        for (int j = 0; j < 3; ++j)
+        {
+            tri.v[j] = clip_verts.col(i[j]);
+            view_pos[j] = view_verts.col(i[j]);
+            tri.normal[j] = !nor.empty() ? Eigen::Vector3f(view_normals.col(i[j])) : Eigen::Vector3f::Zero();
+            tri.tex_coords[j] = !tex.empty() ? tex[i[j]] : Eigen::Vector2f::Zero();
+            tri.setColor(j, col[i[j]][0], col[i[j]][1], col[i[j]][2]);
+        }
+    }, shader);
+}
+
+template <typename FragmentShader>
+void rst::rasterizer::draw(vtx_buf_id vertex_buffer, ind_buf_id ind_buffer, Primitive type, const FragmentShader& shader)
+{
+    if (type != rst::Primitive::Triangle)
+    {
+        throw std::runtime_error("Drawing primitives other than triangle is not implemented yet!");
+    }
+    auto vtx = vtx_buf.get(handle(vertex_buffer));
+    auto ind = ind_buf.get(handle(ind_buffer));
+    if (vtx.empty() || ind.empty())
+        return;
+
+    setup_transforms();
+    if (outside_frustum(vtx_bounds[vertex_buffer.vtx_id]))
+        return;
+    constexpr int stride = sizeof(vertex) / sizeof(float);
+    transform_vertices(vtx[0].position.data(), vtx[0].normal.data(), vtx.size, stride);
+
+    draw_binned(ind.size, [&](int k, Triangle& tri, std::array<Eigen::Vector3f, 3>& view_pos) {
+        const Eigen::Vector3i& i = ind[k];
+        for (int j = 0; j < 3; ++j)
+        {
+            const vertex& v = vtx[i[j]];
+            tri.v[j] = clip_verts.col(i[j]);
+            view_pos[j] = view_verts.col(i[j]);
+            tri.normal[j] = view_normals.col(i[j]);
+            tri.tex_coords[j] = v.tex_coords;
+            tri.setColor(j, v.color[0], v.color[1], v.color[2]);
+        }
+    }, shader);
+}
+
+// Two-phase parallel draw of n triangles, where assemble(i, tri, view_pos) produces the
+// i-th triangle in clip space:
+//   1. the triangles are split into one contiguous chunk per thread; each thread
+//      assembles its chunk, passes every triangle through clip_triangle() into its own
+//      list of screen-space triangles, and bins those into the screen tiles their
+//      bounding boxes overlap, in its own per-tile lists.
+//   2. threads grab whole screen tiles and rasterize that tile's triangles clipped to
+//      the tile. Tiles cover disjoint pixels, so frame_buf/depth_buf need no locks,
+//      and walking the chunks in order keeps submission order inside every tile.
+template <typename Assemble, typename FragmentShader>
+void rst::rasterizer::draw_binned(int n, Assemble&& assemble, const FragmentShader& shader)
+{
+    int tiles_x = (width + bin_size - 1) / bin_size;
+    int tiles_y = (height + bin_size - 1) / bin_size;
+    int chunks = std::max(1, std::min(num_threads, n));
+
+    std::vector<std::vector<Triangle>> screen_tris(chunks);
+    std::vector<std::vector<std::array<Eigen::Vector3f, 3>>> view_pos(chunks);
+    std::vector<std::vector<std::vector<int>>> bins(chunks, std::vector<std::vector<int>>(tiles_x * tiles_y));
+
+    detail::parallel_for(chunks, num_threads, [&](int c) {
+        auto& tris = screen_tris[c];
+        auto& chunk_bins = bins[c];
+        tris.reserve((long)n * (c + 1) / chunks - (long)n * c / chunks);
+        Triangle clip_tri;
+        std::array<Eigen::Vector3f, 3> clip_view_pos;
+        for (int i = (long)n * c / chunks; i < (long)n * (c + 1) / chunks; ++i)
+        {
+            assemble(i, clip_tri, clip_view_pos);
+            int first = tris.size();
+            clip_triangle(clip_tri, clip_view_pos, tris, view_pos[c]);
+
+            for (int k = first; k < (int)tris.size(); ++k)
+            {
+                const Vector4f* v = tris[k].v;
+                float min_x = std::min({v[0].x(), v[1].x(), v[2].x()});
+                float min_y = std::min({v[0].y(), v[1].y(), v[2].y()});
+                float max_x = std::max({v[0].x(), v[1].x(), v[2].x()});
+                float max_y = std::max({v[0].y(), v[1].y(), v[2].y()});
+                if (!(max_x >= 0 && max_y >= 0 && min_x < width && min_y < height))
+                    continue;
+
+                int tx0 = (int)std::max(min_x, 0.0f) / bin_size, tx1 = (int)std::min(max_x, width - 1.0f) / bin_size;
+                int ty0 = (int)std::max(min_y, 0.0f) / bin_size, ty1 = (int)std::min(max_y, height - 1.0f) / bin_size;
+                for (int ty = ty0; ty <= ty1; ++ty)
+                    for (int tx = tx0; tx <= tx1; ++tx)
+                        chunk_bins[ty * tiles_x + tx].push_back(k);
+            }
+        }
+    });
+
+    detail::parallel_for(tiles_x * tiles_y, num_threads, [&](int tile) {
+        int x0 = (tile % tiles_x) * bin_size, y0 = (tile / tiles_x) * bin_size;
+        int x1 = std::min(x0 + bin_size, width) - 1, y1 = std::min(y0 + bin_size, height) - 1;
+        for (int c = 0; c < chunks; ++c)
+            for (int k : bins[c][tile])
+                rasterize_triangle(screen_tris[c][k], view_pos[c][k], x0, y0, x1, y1, shader);
+    });
+}
+
+//Screen space rasterization
+template <typename FragmentShader>
+void rst::rasterizer::rasterize_triangle(const Triangle& t, const std::array<Eigen::Vector3f, 3>& view_pos,
+                                         int clip_min_x, int clip_min_y, int clip_max_x, int clip_max_y,
+                                         const FragmentShader& shader)
+{
+    auto v = t.v;
+    detail::edge_setup setup;
+    if (!detail::setup_triangle(v, clip_min_x, clip_min_y, clip_max_x, clip_max_y, setup))
+        return;
+
+    // Screen space depth is affine in x and y: zp(x, y) = dz_dx * x + dz_dy * y + dz_c,
+    // relative to the same origin as the edge functions. Its range over a block bounds
+    // every fragment in it without touching a pixel.
+    float z[3] = {v[0].z(), v[1].z(), v[2].z()};
+    float tri_zmin = std::min({z[0], z[1], z[2]});
+    float tri_zmax = std::max({z[0], z[1], z[2]});
+    float dz_dx = (setup.A[0] * z[0] + setup.A[1] * z[1] + setup.A[2] * z[2]) * setup.inv_area;
+    float dz_dy = (setup.B[0] * z[0] + setup.B[1] * z[1] + setup.B[2] * z[2]) * setup.inv_area;
+    float dz_c = (setup.C[0] * z[0] + setup.C[1] * z[1] + setup.C[2] * z[2]) * setup.inv_area;
+
+    // Whole triangle rejection: nothing to do if it lies behind every tile it overlaps.
+    bool occluded = true;
+    for (int ty = setup.min_y / detail::raster_tile; occluded && ty <= setup.max_y / detail::raster_tile; ++ty)
+        for (int tx = setup.min_x / detail::raster_tile; tx <= setup.max_x / detail::raster_tile; ++tx)
+            if (tri_zmin < depth_tile_max[ty * depth_tiles_x + tx])
+            {
+                occluded = false;
+                break;
+            }
+    if (occluded)
+        return;
+
+    // Per-vertex parts of the perspective-correct interpolation, done once per triangle:
+    //    * v[i].w() is the vertex view space depth value z.
+    //    * Z is interpolated view space depth for the current pixel, only needed
+    //      by fragments that pass the depth test. Attributes divided by w are affine in
+    //      screen space, so an attribute is sum(b_i * a_i / w_i) * Z.
+    float inv_w[3] = {1.0f / v[0].w(), 1.0f / v[1].w(), 1.0f / v[2].w()};
+    Texture* tex = texture ? &*texture : nullptr;
+
+    detail::for_each_covered_block(setup, [&](int x0, int y0, int x1, int y1, bool inside) {
+        int tile = (y0 / detail::raster_tile) * depth_tiles_x + x0 / detail::raster_tile;
+        int rx0 = x0 - setup.min_x, ry0 = y0 - setup.min_y, rx1 = x1 - setup.min_x, ry1 = y1 - setup.min_y;
+        float block_zmin = std::max(tri_zmin, dz_c + dz_dx * (dz_dx > 0 ? rx0 : rx1) + dz_dy * (dz_dy > 0 ? ry0 : ry1));
+        float block_zmax = std::min(tri_zmax, dz_c + dz_dx * (dz_dx > 0 ? rx1 : rx0) + dz_dy * (dz_dy > 0 ? ry1 : ry0));
+        if (block_zmin >= depth_tile_max[tile])
+            return; // hidden behind everything already in the tile
+        // in front of everything in the tile, so every fragment passes
+        bool all_pass = block_zmax < depth_tile_min[tile];
+
+        bool written = false;
+        if constexpr (detail::is_depth_only<FragmentShader>)
+        {
+            detail::for_each_pixel_in_block(setup, x0, y0, x1, y1, inside, [&](int x, int y, float, float beta, float gamma) {
+                float zp = z[0] + beta * (z[1] - z[0]) + gamma * (z[2] - z[0]);
+                int buf_index = get_index(x, y);
+                if (!all_pass && zp >= depth_buf[buf_index]) return;
+                depth_buf[buf_index] = zp;
+                written = true;
+            });
+        }
+        else if constexpr (detail::is_batch_shader<FragmentShader>)
+        {
+            detail::for_each_group_in_block(setup, x0, y0, x1, y1, [&](int gx, int gy, const detail::lanes* e, detail::lane_mask active) {
+                detail::lanes alpha = e[0] * setup.inv_area, beta = e[1] * setup.inv_area, gamma = e[2] * setup.inv_area;
+
+                // early depth test and write, before any attribute is interpolated
+                detail::lanes zp = z[0] + beta * (z[1] - z[0]) + gamma * (z[2] - z[0]);
+                int buf_index[fragment_shader_batch::size];
+                for (int i = 0; i < fragment_shader_batch::size; ++i)
+                {
+                    if (!active[i]) continue;
+                    buf_index[i] = get_index(gx + i % 4, gy + i / 4);
+                    if (!all_pass && zp[i] >= depth_buf[buf_index[i]])
+                        active[i] = false;
+                    else
+                        depth_buf[buf_index[i]] = zp[i];
+                }
+                if (!active.any()) return;
+                written = true;
+
+                // all lanes are interpolated, the inactive ones only feed the derivatives
+                detail::lanes inv_Z = alpha * inv_w[0] + beta * inv_w[1] + gamma * inv_w[2];
+                detail::lanes Z = inv_Z.inverse();
+                alpha *= inv_w[0] * Z;
+                beta *= inv_w[1] * Z;
+                gamma *= inv_w[2] * Z;
+                auto interpolate = [&](const auto& a0, const auto& a1, const auto& a2, auto& out) {
+                    for (int c = 0; c < out.cols(); ++c)
+                        out.col(c) = alpha * a0[c] + beta * a1[c] + gamma * a2[c];
+                };
+                fragment_shader_batch batch;
+                interpolate(t.color[0], t.color[1], t.color[2], batch.color);
+                interpolate(t.normal[0], t.normal[1], t.normal[2], batch.normal);
+                interpolate(t.tex_coords[0], t.tex_coords[1], t.tex_coords[2], batch.tex_coords);
+                interpolate(view_pos[0], view_pos[1], view_pos[2], batch.view_pos);
+                detail::lanes inv_norm = (batch.normal.col(0).square() + batch.normal.col(1).square() + batch.normal.col(2).square()).rsqrt();
+                for (int c = 0; c < 3; ++c)
+                    batch.normal.col(c) *= inv_norm;
+                batch.active = active;
+                batch.texture = tex;
+                batch.x = gx;
+                batch.y = gy;
+
+                fragment_shader_batch::lanes3 colors = shader(batch);
+                for (int i = 0; i < fragment_shader_batch::size; ++i)
+                    if (active[i])
+                        store_color(buf_index[i], colors.row(i).matrix().transpose());
+            });
+        }
+        else
+        {
+            detail::for_each_pixel_in_block(setup, x0, y0, x1, y1, inside, [&](int x, int y, float alpha, float beta, float gamma) {
+                // early depth test and write, before any attribute is interpolated
+                // (relative to z[0], as the barycentrics carry much less precision than z)
+                float zp = z[0] + beta * (z[1] - z[0]) + gamma * (z[2] - z[0]);
+                int buf_index = get_index(x, y);
+                if (!all_pass && zp >= depth_buf[buf_index]) return;
+                depth_buf[buf_index] = zp;
+                written = true;
+
+                float Z = 1.0f / (alpha * inv_w[0] + beta * inv_w[1] + gamma * inv_w[2]);
+                alpha *= inv_w[0] * Z;
+                beta *= inv_w[1] * Z;
+                gamma *= inv_w[2] * Z;
+                auto interpolated_color = detail::interpolate(alpha, beta, gamma, t.color[0], t.color[1], t.color[2]);
+                auto interpolated_normal = detail::interpolate(alpha, beta, gamma, t.normal[0], t.normal[1], t.normal[2]);
+                auto interpolated_texcoords = detail::interpolate(alpha, beta, gamma, t.tex_coords[0], t.tex_coords[1], t.tex_coords[2]);
+                auto interpolated_shadingcoords = detail::interpolate(alpha, beta, gamma, view_pos[0], view_pos[1], view_pos[2]);
+
+                fragment_shader_payload payload( interpolated_color, interpolated_normal.normalized(), interpolated_texcoords, tex);
+                payload.view_pos = interpolated_shadingcoords;
+                payload.x = x;
+                payload.y = y;
+                store_color(buf_index, shader(payload));
+            });
+        }
+        if (written)
+            update_depth_tile(x0, y0);
+    });
+}
+
@@ -0,0 +1,66 @@
+//
+// Background image output for batch rendering.
+//
+
+#include "frame_writer.hpp"
+#include <algorithm>
+#include <opencv2/opencv.hpp>
+
+frame_writer::frame_writer(int w, int h, size_t capacity) : width(w), height(h), capacity(std::max<size_t>(1, capacity))
+{
+    worker = std::thread([this] { run(); });
+}
+
+frame_writer::~frame_writer()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+    }
+    not_empty.notify_one();
+    worker.join();
+}
+
+std::vector<u08> frame_writer::acquire()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (free_buffers.empty())
+        return std::vector<u08>(3 * width * height);
+    std::vector<u08> pixels = std::move(free_buffers.back());
+    free_buffers.pop_back();
+    return pixels;
+}
+
+void frame_writer::push(std::string filename, std::vector<u08> pixels)
+{
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return queue.size() < capacity; });
+        queue.push_back({std::move(filename), std::move(pixels)});
+    }
+    not_empty.notify_one();
+}
+
+void frame_writer::run()
+{
+    for (;;)
+    {
+        frame f;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            not_empty.wait(lock, [this] { return done || !queue.empty(); });
+            if (queue.empty())
+                return;
+            f = std::move(queue.front());
+            queue.pop_front();
+        }
+        not_full.notify_one();
+
+        // the encoder reads the packed pixels in place, no conversion
+        cv::Mat image(height, width, CV_8UC3, f.pixels.data());
+        cv::imwrite(f.filename, image);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        free_buffers.push_back(std::move(f.pixels));
+    }
+}
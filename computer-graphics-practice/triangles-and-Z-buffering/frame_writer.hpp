@@ -0,0 +1,53 @@
+//
+// Background image output for batch rendering.
+//
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "global.hpp"
+
+// Encodes and writes frames on a background thread, so rendering the next frame overlaps
+// the encoding of the previous ones. Frames are packed 8-bit BGR images, top row first,
+// as returned by rst::rasterizer::frame_buffer(). At most capacity frames wait in the
+// queue: push() blocks while it is full, which bounds memory when encoding is slower
+// than rendering. Written frames give their buffers back to acquire().
+class frame_writer
+{
+public:
+    frame_writer(int width, int height, size_t capacity = 4);
+    // writes the frames still queued, then stops the thread
+    ~frame_writer();
+
+    frame_writer(const frame_writer&) = delete;
+    frame_writer& operator=(const frame_writer&) = delete;
+
+    // a buffer for one frame, recycled from an already written one when possible
+    std::vector<u08> acquire();
+    void push(std::string filename, std::vector<u08> pixels);
+
+private:
+    struct frame
+    {
+        std::string filename;
+        std::vector<u08> pixels;
+    };
+
+    void run();
+
+    int width, height;
+    size_t capacity;
+
+    std::mutex mutex;
+    std::condition_variable not_empty, not_full;
+    std::deque<frame> queue;
+    std::vector<std::vector<u08>> free_buffers;
+    bool done = false;
+
+    std::thread worker;
+};
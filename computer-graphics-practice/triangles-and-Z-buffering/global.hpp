@@ -5,6 +5,8 @@
 #ifndef RASTERIZER_GLOBAL_H
 #define RASTERIZER_GLOBAL_H
 
+typedef unsigned char u08;
+
 //#define MY_PI 3.1415926
 //#define TWO_PI (2.0* MY_PI)
 
@@ -1,9 +1,11 @@
 // clang-format off
+#include <chrono>
 #include <iostream>
 #include <opencv2/opencv.hpp>
 #include "rasterizer.hpp"
 #include "global.hpp"
 #include "Triangle.hpp"
+#include "frame_writer.hpp"
 
 constexpr double MY_PI = 3.1415926;
 inline float deg2rad(float degrees) { return degrees * MY_PI / 180.0; }
@@ -47,13 +49,25 @@ int main(int argc, const char** argv)
     bool command_line = false;
     std::string filename = "output.png";
 
-    if (argc == 2)
+    // Rasterizer [--frames N] output.png. With --frames, the camera sweeps from left to
+    // right over N frames, rendered headless to output0000.png, output0001.png, ...
+    std::vector<std::string> args(argv + 1, argv + argc);
+    int frames = 0;
+    if (args.size() >= 2 && args[0] == "--frames")
+    {
+        frames = std::max(1, std::stoi(args[1]));
+        args.erase(args.begin(), args.begin() + 2);
+    }
+
+    if (args.size() == 1)
     {
         command_line = true;
-        filename = std::string(argv[1]);
+        filename = args[0];
     }
 
     rst::rasterizer r(700, 700);
+    // 4x MSAA: edges as smooth as 2x2 supersampling, with one color write per pixel
+    r.set_msaa(4);
 
     Eigen::Vector3f eye_pos = {0,0,5};
 
@@ -91,6 +105,43 @@ int main(int argc, const char** argv)
     int key = 0;
     int frame_count = 0;
 
+    if (frames > 0)
+    {
+        // "out.png" -> "out0042.png"
+        auto frame_name = [&](int i) {
+            std::string number = std::to_string(i);
+            number.insert(0, std::max(0, 4 - (int)number.size()), '0');
+            size_t dot = filename.rfind('.');
+            return dot == std::string::npos ? filename + number : filename.substr(0, dot) + number + filename.substr(dot);
+        };
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            frame_writer writer(700, 700);
+            for (int i = 0; i < frames; ++i)
+            {
+                r.clear(rst::Buffers::Color | rst::Buffers::Depth);
+
+                Eigen::Vector3f frame_eye = eye_pos;
+                frame_eye.x() += frames > 1 ? -1.0f + 2.0f * i / (frames - 1) : 0.0f;
+                r.set_model(get_model_matrix(angle));
+                r.set_view(get_view_matrix(frame_eye));
+                r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
+
+                r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, false);
+                // hand the finished frame to the writer and render the next one into a
+                // recycled buffer, which clear() resets
+                std::vector<u08> pixels = writer.acquire();
+                std::swap(pixels, r.frame_buffer());
+                writer.push(frame_name(i), std::move(pixels));
+            }
+        }
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        std::cout << frames << " frames in " << seconds.count() << " s, "
+                  << frames / seconds.count() << " frames/s\n";
+        return 0;
+    }
+
     if (command_line)
     {
         r.clear(rst::Buffers::Color | rst::Buffers::Depth);
@@ -99,11 +150,8 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
-        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, true);
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
-
+        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, false);
+        cv::Mat image(700, 700, CV_8UC3, r.frame_buffer().data());
         cv::imwrite(filename, image);
 
         return 0;
@@ -117,11 +165,9 @@ int main(int argc, const char** argv)
         r.set_view(get_view_matrix(eye_pos));
         r.set_projection(get_projection_matrix(45, 1, 0.1, 50));
 
-        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, true);
+        r.draw(pos_id, ind_id, col_id, rst::Primitive::Triangle, false);
 
-        cv::Mat image(700, 700, CV_32FC3, r.frame_buffer().data());
-        image.convertTo(image, CV_8UC3, 1.0f);
-        cv::cvtColor(image, image, cv::COLOR_RGB2BGR);
+        cv::Mat image(700, 700, CV_8UC3, r.frame_buffer().data());
         cv::imshow("image", image);
         key = cv::waitKey(10);
 
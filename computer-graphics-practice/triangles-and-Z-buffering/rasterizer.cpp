@@ -15,6 +15,19 @@ rst::pos_buf_id rst::rasterizer::load_positions(const std::vector<Eigen::Vector3
     auto id = get_next_id();
     pos_buf.emplace(id, positions);
 
+    // bounding sphere around the center of the bounding box, for frustum culling
+    Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::infinity()), hi = -lo;
+    for (auto& p : positions)
+    {
+        lo = lo.cwiseMin(p);
+        hi = hi.cwiseMax(p);
+    }
+    Eigen::Vector3f center = positions.empty() ? Eigen::Vector3f::Zero() : Eigen::Vector3f(0.5f * (lo + hi));
+    float radius = 0;
+    for (auto& p : positions)
+        radius = std::max(radius, (p - center).squaredNorm());
+    pos_bounds[id] << center, std::sqrt(radius);
+
     return {id};
 }
 
@@ -40,24 +53,110 @@ auto to_vec4(const Eigen::Vector3f& v3, float w = 1.0f)
 }
 
 
-static bool insideTriangle(int x, int y, const Vector3f* _v)
-{   
-    // check if the point (x, y) is inside the triangle represented by _v[0], _v[1], _v[2]
-    Eigen::Vector3f P(x, y, 0);
+// Edge functions of a screen-space triangle, E_i(x, y) = A_i * x + B_i * y + C_i,
+// where E_i belongs to the edge opposite vertex i. Dividing by E_i(v_i), which is
+// twice the signed area, gives the barycentric coordinates directly, so a sample is
+// inside when all three are >= 0. Clockwise triangles get their signs flipped.
+struct edge_setup
+{
+    float A[3], B[3], C[3];
+    float inv_area;
+    int min_x, min_y, max_x, max_y; // bounding box clamped to the sample grid
+};
+
+// size of the screen blocks tested against the edge functions as a whole
+constexpr int raster_tile = 8;
+
+// The bounding box is grown by pad pixels on every side before it is clamped.
+static bool setup_triangle(const Vector4f* v, int width, int height, edge_setup& s, int pad = 0)
+{
+    for (int i = 0; i < 3; ++i)
+    {
+        const Vector4f& p = v[(i + 1) % 3];
+        const Vector4f& q = v[(i + 2) % 3];
+        s.A[i] = p.y() - q.y();
+        s.B[i] = q.x() - p.x();
+        s.C[i] = p.x() * q.y() - q.x() * p.y();
+    }
+    float area = s.A[0] * v[0].x() + s.B[0] * v[0].y() + s.C[0];
+    if (area == 0 || !std::isfinite(area))
+        return false;
+    if (area < 0)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            s.A[i] = -s.A[i];
+            s.B[i] = -s.B[i];
+            s.C[i] = -s.C[i];
+        }
+        area = -area;
+    }
+    s.inv_area = 1.0f / area;
+
+    s.min_x = std::max(0, (int)std::floor(std::min({v[0].x(), v[1].x(), v[2].x()})) - pad);
+    s.min_y = std::max(0, (int)std::floor(std::min({v[0].y(), v[1].y(), v[2].y()})) - pad);
+    s.max_x = std::min(width - 1, (int)std::floor(std::max({v[0].x(), v[1].x(), v[2].x()})) + pad);
+    s.max_y = std::min(height - 1, (int)std::floor(std::max({v[0].y(), v[1].y(), v[2].y()})) + pad);
+    return s.min_x <= s.max_x && s.min_y <= s.max_y;
+}
 
-    Eigen::Vector3f cross_AB_P = (_v[1] - _v[0]).cross(P - _v[0]);
-    Eigen::Vector3f cross_BC_P = (_v[2] - _v[1]).cross(P - _v[1]);
-    Eigen::Vector3f cross_CA_P = (_v[0] - _v[2]).cross(P - _v[2]);
-    // check if these 3 cross products have the same sign
-    return (cross_AB_P.z()>=0 == cross_BC_P.z()>=0) && (cross_BC_P.z()>=0 == cross_CA_P.z()>=0);
+// Classifies the rectangle [x0, x1] x [y0, y1] against the edge functions: outside when
+// one of them is negative at all of its corners, inside when all three are non-negative
+// at all corners.
+static void classify_block(const edge_setup& s, float x0, float y0, float x1, float y1, bool& outside, bool& inside)
+{
+    outside = false;
+    inside = true;
+    for (int i = 0; i < 3; ++i)
+    {
+        // E is linear, so its extremes over the block are at the corners
+        float e_max = s.C[i] + s.A[i] * (s.A[i] > 0 ? x1 : x0) + s.B[i] * (s.B[i] > 0 ? y1 : y0);
+        float e_min = s.C[i] + s.A[i] * (s.A[i] > 0 ? x0 : x1) + s.B[i] * (s.B[i] > 0 ? y0 : y1);
+        outside |= e_max < 0;
+        inside &= e_min >= 0;
+    }
 }
 
-static std::tuple<float, float, float> computeBarycentric2D(float x, float y, const Vector3f* v)
+// Calls visit(x, y, alpha, beta, gamma) for every covered sample. The bounding box is
+// walked in raster_tile blocks: a block is skipped when one edge function is negative
+// at all of its corners, and accepted without per-sample tests when all three are
+// non-negative at all corners. Inside a block the edge functions are stepped with adds.
+template <typename Visit>
+static void for_each_covered_pixel(const edge_setup& s, Visit&& visit)
 {
-    float c1 = (x*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*y + v[1].x()*v[2].y() - v[2].x()*v[1].y()) / (v[0].x()*(v[1].y() - v[2].y()) + (v[2].x() - v[1].x())*v[0].y() + v[1].x()*v[2].y() - v[2].x()*v[1].y());
-    float c2 = (x*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*y + v[2].x()*v[0].y() - v[0].x()*v[2].y()) / (v[1].x()*(v[2].y() - v[0].y()) + (v[0].x() - v[2].x())*v[1].y() + v[2].x()*v[0].y() - v[0].x()*v[2].y());
-    float c3 = (x*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*y + v[0].x()*v[1].y() - v[1].x()*v[0].y()) / (v[2].x()*(v[0].y() - v[1].y()) + (v[1].x() - v[0].x())*v[2].y() + v[0].x()*v[1].y() - v[1].x()*v[0].y());
-    return {c1,c2,c3};
+    for (int ty = s.min_y; ty <= s.max_y; ty += raster_tile)
+    {
+        int y1 = std::min(ty + raster_tile - 1, s.max_y);
+        for (int tx = s.min_x; tx <= s.max_x; tx += raster_tile)
+        {
+            int x1 = std::min(tx + raster_tile - 1, s.max_x);
+
+            bool outside, inside;
+            classify_block(s, tx, ty, x1, y1, outside, inside);
+            if (outside)
+                continue;
+
+            float e_row[3];
+            for (int i = 0; i < 3; ++i)
+                e_row[i] = s.A[i] * tx + s.B[i] * ty + s.C[i];
+
+            for (int y = ty; y <= y1; ++y)
+            {
+                float e0 = e_row[0], e1 = e_row[1], e2 = e_row[2];
+                for (int x = tx; x <= x1; ++x)
+                {
+                    if (inside || (e0 >= 0 && e1 >= 0 && e2 >= 0))
+                        visit(x, y, e0 * s.inv_area, e1 * s.inv_area, e2 * s.inv_area);
+                    e0 += s.A[0];
+                    e1 += s.A[1];
+                    e2 += s.A[2];
+                }
+                e_row[0] += s.B[0];
+                e_row[1] += s.B[1];
+                e_row[2] += s.B[2];
+            }
+        }
+    }
 }
 
 void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, bool superSampling)
@@ -66,113 +165,198 @@ void rst::rasterizer::draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf
     auto& ind = ind_buf[ind_buffer.ind_id];
     auto& col = col_buf[col_buffer.col_id];
 
-    float f1 = (50 - 0.1) / 2.0;
-    float f2 = (50 + 0.1) / 2.0;
+    if (superSampling && ss_frame_buf.empty()){
+        ss_frame_buf.resize(2*width * 2*height, Eigen::Vector3f{0, 0, 0});
+        ss_depth_buf.resize(2*width * 2*height, std::numeric_limits<float>::infinity());
+    }
 
     Eigen::Matrix4f mvp = projection * view * model;
-    for (auto& i : ind)
+    if (!outside_frustum(pos_bounds[pos_buffer.pos_id], view * model))
     {
-        Triangle t;
-        Eigen::Vector4f v[] = {
-                mvp * to_vec4(buf[i[0]], 1.0f),
-                mvp * to_vec4(buf[i[1]], 1.0f),
-                mvp * to_vec4(buf[i[2]], 1.0f)
-        };
-        //Homogeneous division
-        for (auto& vec : v) {
-            vec /= vec.w();
-        }
-        //Viewport transformation
-        for (auto & vert : v)
+        for (auto& i : ind)
         {
-            vert.x() = 0.5*width*(vert.x()+1.0);
-            vert.y() = 0.5*height*(vert.y()+1.0);
-            vert.z() = vert.z() * f1 + f2;
+            Eigen::Vector4f v[] = {
+                    mvp * to_vec4(buf[i[0]], 1.0f),
+                    mvp * to_vec4(buf[i[1]], 1.0f),
+                    mvp * to_vec4(buf[i[2]], 1.0f)
+            };
+            Eigen::Vector3f colors[] = {col[i[0]], col[i[1]], col[i[2]]};
+            clip_triangle(v, colors, superSampling);
         }
+    }
+    if (superSampling){
+        downsample();
+    }
+    else if (msaa_samples > 1){
+        resolve_msaa();
+    }
+}
 
-        for (int i = 0; i < 3; ++i)
+// Per-mesh frustum culling: true when the bounding sphere (center, radius), transformed
+// by modelview, lies entirely outside one plane of the view frustum. The planes follow
+// from the projection matrix, a view space point is inside when w +- x, w +- y and
+// w +- z are all non-negative in clip space.
+bool rst::rasterizer::outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& modelview) const
+{
+    Eigen::Matrix3f linear = modelview.topLeftCorner<3, 3>();
+    Eigen::Vector4f center;
+    center << linear * sphere.head<3>() + modelview.col(3).head<3>(), 1;
+    // the longest transformed axis bounds the radius under any scaling
+    float radius = sphere.w() * linear.colwise().norm().maxCoeff();
+
+    for (int i = 0; i < 3; ++i)
+    {
+        for (float sign : {1.0f, -1.0f})
         {
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
-            t.setVertex(i, v[i].head<3>());
+            Eigen::Vector4f plane = projection.row(3) + sign * projection.row(i);
+            if (plane.dot(center) < -radius * plane.head<3>().norm())
+                return true;
         }
+    }
+    return false;
+}
 
-        auto col_x = col[i[0]];
-        auto col_y = col[i[1]];
-        auto col_z = col[i[2]];
+// A polygon vertex during clipping, position and color are both linear in clip space.
+struct clip_vertex
+{
+    Eigen::Vector4f pos;
+    Eigen::Vector3f color;
+};
+
+// Sutherland-Hodgman: clips the convex polygon in[0, n) to the half space where the
+// plane distance d(pos) >= 0, writing at most n + 1 vertices to out. Returns their count.
+template <typename Distance>
+static int clip_polygon(const clip_vertex* in, int n, clip_vertex* out, Distance d)
+{
+    int m = 0;
+    for (int i = 0; i < n; ++i)
+    {
+        const clip_vertex& a = in[i];
+        const clip_vertex& b = in[(i + 1) % n];
+        float da = d(a.pos), db = d(b.pos);
+        if (da >= 0)
+            out[m++] = a;
+        if ((da >= 0) != (db >= 0))
+        {
+            float t = da / (da - db);
+            out[m++] = {a.pos + t * (b.pos - a.pos), a.color + t * (b.color - a.color)};
+        }
+    }
+    return m;
+}
 
-        t.setColor(0, col_x[0], col_x[1], col_x[2]);
-        t.setColor(1, col_y[0], col_y[1], col_y[2]);
-        t.setColor(2, col_z[0], col_z[1], col_z[2]);
-        rasterize_triangle(t, superSampling);
+void rst::rasterizer::clip_triangle(const Eigen::Vector4f* v, const Eigen::Vector3f* colors, bool superSampling)
+{
+    // trivial rejection: all three vertices outside the same frustum plane
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        if ((v[0][axis] < -v[0].w() && v[1][axis] < -v[1].w() && v[2][axis] < -v[2].w()) ||
+            (v[0][axis] > v[0].w() && v[1][axis] > v[1].w() && v[2][axis] > v[2].w()))
+            return;
     }
-    if (superSampling){
-        downsample();
+
+    clip_vertex poly[8], scratch[8]; // 3 vertices plus at most one more per clip plane
+    int n = 3;
+    for (int i = 0; i < 3; ++i)
+        poly[i] = {v[i], colors[i]};
+    // only planes some vertex is on the wrong side of need a clipping pass
+    auto clip = [&](auto distance) {
+        if (n >= 3 && (distance(v[0]) < 0 || distance(v[1]) < 0 || distance(v[2]) < 0))
+        {
+            n = clip_polygon(poly, n, scratch, distance);
+            std::copy(scratch, scratch + n, poly);
+        }
+    };
+    clip([](const Eigen::Vector4f& p) { return p.z() + p.w(); }); // near
+    clip([](const Eigen::Vector4f& p) { return p.x() + guard_band * p.w(); });
+    clip([](const Eigen::Vector4f& p) { return guard_band * p.w() - p.x(); });
+    clip([](const Eigen::Vector4f& p) { return p.y() + guard_band * p.w(); });
+    clip([](const Eigen::Vector4f& p) { return guard_band * p.w() - p.y(); });
+    if (n < 3)
+        return;
+
+    float f1 = (50 - 0.1) / 2.0;
+    float f2 = (50 + 0.1) / 2.0;
+
+    // homogeneous division and viewport transformation
+    Eigen::Vector3f screen[8];
+    for (int i = 0; i < n; ++i)
+    {
+        Eigen::Vector4f ndc = poly[i].pos / poly[i].pos.w();
+        screen[i].x() = 0.5*width*(ndc.x()+1.0);
+        screen[i].y() = 0.5*height*(ndc.y()+1.0);
+        screen[i].z() = ndc.z() * f1 + f2;
+    }
+
+    // back-face culling on the signed area, positive when counter-clockwise
+    float area = 0;
+    for (int i = 0; i < n; ++i)
+        area += screen[i].x() * screen[(i + 1) % n].y() - screen[(i + 1) % n].x() * screen[i].y();
+    if ((cull_mode == Cull::Back && area <= 0) || (cull_mode == Cull::Front && area >= 0))
+        return;
+
+    // the clipped polygon is convex, so a fan from its first vertex covers it
+    for (int i = 1; i + 1 < n; ++i)
+    {
+        Triangle t;
+        int k[3] = {0, i, i + 1};
+        for (int j = 0; j < 3; ++j)
+        {
+            t.setVertex(j, screen[k[j]]);
+            const Eigen::Vector3f& c = poly[k[j]].color;
+            t.setColor(j, c[0], c[1], c[2]);
+        }
+        if (!superSampling && msaa_samples > 1)
+            rasterize_triangle_msaa(t);
+        else
+            rasterize_triangle(t, superSampling);
     }
 }
 
 //Screen space rasterization
 void rst::rasterizer::rasterize_triangle(const Triangle& t, bool superSampling) {
     auto v = t.toVector4();
-    
-    // Find out the bounding box of current triangle.
-    float aabb_min_x = std::min(v[0].x(), std::min(v[1].x(), v[2].x()));
-    float aabb_min_y = std::min(v[0].y(), std::min(v[1].y(), v[2].y()));
-    float aabb_max_x = std::max(v[0].x(), std::max(v[1].x(), v[2].x()));
-    float aabb_max_y = std::max(v[0].y(), std::max(v[1].y(), v[2].y()));
-
-    // Super-sampling: 2x2 grid
-    // iterate through the pixel and find if the current pixel is inside the triangle
+
+    // Super-sampling: 2x2 grid. The triangle is set up in the 2x sample space,
+    // where every integer position is one subsample.
+    int scale = superSampling ? 2 : 1;
     if (superSampling){
-        for (int x=2*aabb_min_x; x<=2*aabb_max_x; ++x){
-            for (int y=2*aabb_min_y; y<=2*aabb_max_y; ++y){
-                float ss_x = x / 2.0;
-                float ss_y = y / 2.0;
-                if (!insideTriangle(ss_x, ss_y, t.v)){
-                    continue;
-                }
-                // compute the interpolated z value
-                auto[alpha, beta, gamma] = computeBarycentric2D(ss_x, ss_y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
-                // original get_index: (height-1-y)*width + x
-                int buf_index = (2*height-1-y)*2*width + x;
-                if (z_interpolated < ss_depth_buf[buf_index]){
-                    ss_depth_buf[buf_index] = z_interpolated;
-                    ss_frame_buf[buf_index] = t.getColor();
-                }
-            }
+        for (auto& vert : v){
+            vert.x() *= 2;
+            vert.y() *= 2;
         }
     }
-    else{
-        for (int x=aabb_min_x; x<=aabb_max_x; ++x){
-            for (int y=aabb_min_y; y<=aabb_max_y; ++y){
-                if (!insideTriangle(x, y, t.v)){
-                    continue;
-                }
-                // compute the interpolated z value
-                auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-                float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-                float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-                z_interpolated *= w_reciprocal;
-
-                int buf_index = get_index(x, y);
-                if (z_interpolated < depth_buf[buf_index]){
-                    depth_buf[buf_index] = z_interpolated;
-                    set_pixel(Eigen::Vector3f(x, y, 0), t.getColor());
-                }
+
+    edge_setup setup;
+    if (!setup_triangle(v.data(), scale * width, scale * height, setup))
+        return;
+
+    // per-vertex terms of the interpolated z value, done once per triangle
+    float inv_w[3] = {1.0f / v[0].w(), 1.0f / v[1].w(), 1.0f / v[2].w()};
+    float z_over_w[3] = {v[0].z() * inv_w[0], v[1].z() * inv_w[1], v[2].z() * inv_w[2]};
+    Eigen::Vector3f color = t.getColor();
+
+    for_each_covered_pixel(setup, [&](int x, int y, float alpha, float beta, float gamma) {
+        // compute the interpolated z value
+        float w_reciprocal = 1.0f / (alpha * inv_w[0] + beta * inv_w[1] + gamma * inv_w[2]);
+        float z_interpolated = (alpha * z_over_w[0] + beta * z_over_w[1] + gamma * z_over_w[2]) * w_reciprocal;
+
+        if (superSampling){
+            // original get_index: (height-1-y)*width + x
+            int buf_index = (2*height-1-y)*2*width + x;
+            if (z_interpolated < ss_depth_buf[buf_index]){
+                ss_depth_buf[buf_index] = z_interpolated;
+                ss_frame_buf[buf_index] = color;
             }
         }
-    }
-    
-    // If so, use the following code to get the interpolated z value.
-    //auto[alpha, beta, gamma] = computeBarycentric2D(x, y, t.v);
-    //float w_reciprocal = 1.0/(alpha / v[0].w() + beta / v[1].w() + gamma / v[2].w());
-    //float z_interpolated = alpha * v[0].z() / v[0].w() + beta * v[1].z() / v[1].w() + gamma * v[2].z() / v[2].w();
-    //z_interpolated *= w_reciprocal;
-
-    // TODO : set the current pixel (use the set_pixel function) to the color of the triangle (use getColor function) if it should be painted.
+        else{
+            int buf_index = get_index(x, y);
+            if (z_interpolated < depth_buf[buf_index]){
+                depth_buf[buf_index] = z_interpolated;
+                set_pixel(Eigen::Vector3f(x, y, 0), color);
+            }
+        }
+    });
 }
 
 void rst::rasterizer::downsample(){
@@ -192,6 +376,168 @@ void rst::rasterizer::downsample(){
     }
 }
 
+// Standard sample positions of the 2x, 4x and 8x MSAA patterns, in 1/16 pixel relative
+// to the sample point of the pixel itself. The rotated patterns put every sample on its
+// own row and column, so near-horizontal and near-vertical edges get all coverage levels.
+struct sample_offset
+{
+    int x, y;
+};
+static const sample_offset msaa_pattern_2[] = {{4, 4}, {-4, -4}};
+static const sample_offset msaa_pattern_4[] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+static const sample_offset msaa_pattern_8[] = {{1, -3}, {-1, 3}, {5, 1}, {-3, -5}, {-5, 5}, {-7, -1}, {3, 7}, {7, -7}};
+
+static const sample_offset* msaa_pattern(int samples)
+{
+    return samples == 2 ? msaa_pattern_2 : samples == 4 ? msaa_pattern_4 : msaa_pattern_8;
+}
+
+void rst::rasterizer::set_msaa(int samples)
+{
+    if (samples != 1 && samples != 2 && samples != 4 && samples != 8)
+    {
+        throw std::runtime_error("MSAA supports 1, 2, 4 or 8 samples per pixel");
+    }
+    msaa_samples = samples;
+    if (samples == 1)
+    {
+        msaa_depth_buf = {};
+        msaa_color_buf = {};
+        msaa_sample_slot = {};
+        msaa_sample_buf = {};
+        msaa_free_slots = {};
+        return;
+    }
+    msaa_depth_buf.assign(width * height * samples, std::numeric_limits<float>::infinity());
+    msaa_color_buf.assign(width * height, Eigen::Vector3f{0, 0, 0});
+    msaa_sample_slot.assign(width * height, -1);
+    msaa_sample_buf.clear();
+    msaa_free_slots.clear();
+}
+
+// Multisampled rasterization: coverage and the depth test run for every sample of a
+// pixel, then the triangle is shaded once for all samples that passed.
+void rst::rasterizer::rasterize_triangle_msaa(const Triangle& t)
+{
+    auto v = t.toVector4();
+
+    // samples lie less than half a pixel away, so pixels just outside the box may be hit
+    edge_setup setup;
+    if (!setup_triangle(v.data(), width, height, setup, 1))
+        return;
+
+    const sample_offset* pattern = msaa_pattern(msaa_samples);
+    float sx[8], sy[8];
+    for (int k = 0; k < msaa_samples; ++k)
+    {
+        sx[k] = pattern[k].x / 16.0f;
+        sy[k] = pattern[k].y / 16.0f;
+    }
+
+    // vertices come with w = 1, so z is affine in screen space
+    float z[3] = {v[0].z(), v[1].z(), v[2].z()};
+    Eigen::Vector3f color = t.getColor();
+
+    for (int ty = setup.min_y; ty <= setup.max_y; ty += raster_tile)
+    {
+        int y1 = std::min(ty + raster_tile - 1, setup.max_y);
+        for (int tx = setup.min_x; tx <= setup.max_x; tx += raster_tile)
+        {
+            int x1 = std::min(tx + raster_tile - 1, setup.max_x);
+
+            // the block grown by half a pixel contains all of its samples
+            bool outside, inside;
+            classify_block(setup, tx - 0.5f, ty - 0.5f, x1 + 0.5f, y1 + 0.5f, outside, inside);
+            if (outside)
+                continue;
+
+            for (int y = ty; y <= y1; ++y)
+            {
+                for (int x = tx; x <= x1; ++x)
+                {
+                    int pixel = get_index(x, y);
+                    float* depth = &msaa_depth_buf[(size_t)pixel * msaa_samples];
+                    unsigned mask = 0;
+                    for (int k = 0; k < msaa_samples; ++k)
+                    {
+                        float e[3];
+                        for (int i = 0; i < 3; ++i)
+                            e[i] = setup.A[i] * (x + sx[k]) + setup.B[i] * (y + sy[k]) + setup.C[i];
+                        if (!inside && (e[0] < 0 || e[1] < 0 || e[2] < 0))
+                            continue;
+                        float z_sample = (e[0] * z[0] + e[1] * z[1] + e[2] * z[2]) * setup.inv_area;
+                        if (z_sample < depth[k])
+                        {
+                            depth[k] = z_sample;
+                            mask |= 1u << k;
+                        }
+                    }
+                    if (mask == 0)
+                        continue;
+                    // one shading result (the flat triangle color) for every sample it won
+                    write_samples(pixel, mask, color);
+                }
+            }
+        }
+    }
+}
+
+// Stores color into the samples in mask of one pixel, switching the pixel between its
+// compressed single color and a slot of per-sample colors as needed.
+void rst::rasterizer::write_samples(int pixel, unsigned mask, const Eigen::Vector3f& color)
+{
+    int& slot = msaa_sample_slot[pixel];
+    if (mask == (1u << msaa_samples) - 1)
+    {
+        // the triangle now owns every sample: back to a single color
+        if (slot >= 0)
+        {
+            msaa_free_slots.push_back(slot);
+            slot = -1;
+        }
+        msaa_color_buf[pixel] = color;
+        return;
+    }
+    if (slot < 0)
+    {
+        // first partial write: expand the compressed color into a slot
+        if (msaa_free_slots.empty())
+        {
+            slot = msaa_sample_buf.size() / msaa_samples;
+            msaa_sample_buf.resize(msaa_sample_buf.size() + msaa_samples);
+        }
+        else
+        {
+            slot = msaa_free_slots.back();
+            msaa_free_slots.pop_back();
+        }
+        std::fill_n(&msaa_sample_buf[(size_t)slot * msaa_samples], msaa_samples, msaa_color_buf[pixel]);
+    }
+    Eigen::Vector3f* samples = &msaa_sample_buf[(size_t)slot * msaa_samples];
+    for (int k = 0; k < msaa_samples; ++k)
+        if (mask & (1u << k))
+            samples[k] = color;
+}
+
+// Averages the samples of every pixel into the frame buffer; compressed pixels are copied.
+void rst::rasterizer::resolve_msaa()
+{
+    for (int pixel = 0; pixel < width * height; ++pixel)
+    {
+        int slot = msaa_sample_slot[pixel];
+        if (slot < 0)
+        {
+            store_color(pixel, msaa_color_buf[pixel]);
+            continue;
+        }
+        const Eigen::Vector3f* samples = &msaa_sample_buf[(size_t)slot * msaa_samples];
+        Eigen::Vector3f color_sum = Eigen::Vector3f(0, 0, 0);
+        for (int k = 0; k < msaa_samples; ++k)
+            color_sum += samples[k];
+        store_color(pixel, color_sum / msaa_samples);
+    }
+}
+
 void rst::rasterizer::set_model(const Eigen::Matrix4f& m)
 {
     model = m;
@@ -211,22 +557,26 @@ void rst::rasterizer::clear(rst::Buffers buff)
 {
     if ((buff & rst::Buffers::Color) == rst::Buffers::Color)
     {
-        std::fill(frame_buf.begin(), frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(frame_buf.begin(), frame_buf.end(), 0);
         std::fill(ss_frame_buf.begin(), ss_frame_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(msaa_color_buf.begin(), msaa_color_buf.end(), Eigen::Vector3f{0, 0, 0});
+        std::fill(msaa_sample_slot.begin(), msaa_sample_slot.end(), -1);
+        msaa_sample_buf.clear();
+        msaa_free_slots.clear();
     }
     if ((buff & rst::Buffers::Depth) == rst::Buffers::Depth)
     {
         std::fill(depth_buf.begin(), depth_buf.end(), std::numeric_limits<float>::infinity());
         std::fill(ss_depth_buf.begin(), ss_depth_buf.end(), std::numeric_limits<float>::infinity());
+        std::fill(msaa_depth_buf.begin(), msaa_depth_buf.end(), std::numeric_limits<float>::infinity());
     }
 }
 
 rst::rasterizer::rasterizer(int w, int h) : width(w), height(h)
 {
-    frame_buf.resize(w * h);
-    ss_frame_buf.resize(2*w * 2*h);
+    frame_buf.resize(3 * w * h);
     depth_buf.resize(w * h);
-    ss_depth_buf.resize(2*w * 2*h);
+    // the 2x2 supersampling buffers are allocated by the first draw that needs them
 }
 
 int rst::rasterizer::get_index(int x, int y)
@@ -238,7 +588,7 @@ void rst::rasterizer::set_pixel(const Eigen::Vector3f& point, const Eigen::Vecto
 {
     //old index: auto ind = point.y() + point.x() * width;
     auto ind = (height-1-point.y())*width + point.x();
-    frame_buf[ind] = color;
+    store_color(ind, color);
 
 }
 
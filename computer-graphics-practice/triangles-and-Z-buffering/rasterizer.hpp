@@ -6,6 +6,7 @@
 
 #include <Eigen/Eigen>
 #include <algorithm>
+#include <cmath>
 #include "global.hpp"
 #include "Triangle.hpp"
 using namespace Eigen;
@@ -54,6 +55,15 @@ namespace rst
         int col_id = 0;
     };
 
+    // Which triangles draw() discards by their screen space winding. Counter-clockwise,
+    // seen with y pointing up, is front facing.
+    enum class Cull
+    {
+        None,
+        Back,
+        Front
+    };
+
     class rasterizer
     {
     public:
@@ -68,19 +78,38 @@ namespace rst
 
         void set_pixel(const Eigen::Vector3f& point, const Eigen::Vector3f& color);
 
+        // back-face culling mode of all later draws, Cull::None by default
+        void set_cull_mode(Cull mode) { cull_mode = mode; }
+
         void clear(Buffers buff);
 
+        // superSampling renders with 2x2 supersampling; without it the draw is multisampled
+        // when set_msaa() asked for more than one sample per pixel
         void draw(pos_buf_id pos_buffer, ind_buf_id ind_buffer, col_buf_id col_buffer, Primitive type, bool superSampling);
 
-        std::vector<Eigen::Vector3f>& frame_buffer() { return frame_buf; }
+        // MSAA with 1 (off), 2, 4 or 8 samples per pixel: coverage and depth are evaluated
+        // per sample, color once per pixel and triangle
+        void set_msaa(int samples);
+
+        // 8-bit BGR pixels, top row first: the layout of a CV_8UC3 image, so the frame
+        // can be encoded or shown without a conversion pass
+        std::vector<u08>& frame_buffer() { return frame_buf; }
 
     private:
         void draw_line(Eigen::Vector3f begin, Eigen::Vector3f end);
 
+        bool outside_frustum(const Eigen::Vector4f& sphere, const Eigen::Matrix4f& modelview) const;
+        // Primitive assembly: culls the triangle with clip space vertices v, clips it against
+        // the near plane and the guard band and rasterizes what is left.
+        void clip_triangle(const Eigen::Vector4f* v, const Eigen::Vector3f* colors, bool superSampling);
         void rasterize_triangle(const Triangle& t, bool superSampling);
 
         void downsample();
 
+        void rasterize_triangle_msaa(const Triangle& t);
+        void write_samples(int pixel, unsigned mask, const Eigen::Vector3f& color);
+        void resolve_msaa();
+
         // VERTEX SHADER -> MVP -> Clipping -> /.W -> VIEWPORT -> DRAWLINE/DRAWTRI -> FRAGSHADER
 
     private:
@@ -91,12 +120,37 @@ namespace rst
         std::map<int, std::vector<Eigen::Vector3f>> pos_buf;
         std::map<int, std::vector<Eigen::Vector3i>> ind_buf;
         std::map<int, std::vector<Eigen::Vector3f>> col_buf;
-
-        std::vector<Eigen::Vector3f> frame_buf;
+        // bounding sphere of every position buffer: center and radius in w
+        std::map<int, Eigen::Vector4f> pos_bounds;
+
+        Cull cull_mode = Cull::None;
+        // Triangles are clipped against x, y = +-guard_band * w rather than the viewport
+        // edges, which the bounding boxes are clamped to anyway; the near plane always.
+        static constexpr float guard_band = 8;
+
+        std::vector<u08> frame_buf;
+        // packs an RGB color in [0, 255] into pixel ind of frame_buf
+        void store_color(int ind, const Eigen::Vector3f& color)
+        {
+            u08* pixel = &frame_buf[3 * ind];
+            for (int c = 0; c < 3; ++c)
+                pixel[2 - c] = (u08)std::clamp(std::lrint(color[c]), 0L, 255L);
+        }
         std::vector<Eigen::Vector3f> ss_frame_buf;
 
         std::vector<float> depth_buf;
         std::vector<float> ss_depth_buf;
+
+        // Multisample buffers. Depth is kept per sample. Color is compressed: a pixel whose
+        // samples all hold the same triangle stores one color in msaa_color_buf and -1 in
+        // msaa_sample_slot; only pixels on triangle edges get a slot of msaa_samples colors
+        // in msaa_sample_buf, which are recycled through msaa_free_slots.
+        int msaa_samples = 1;
+        std::vector<float> msaa_depth_buf;
+        std::vector<Eigen::Vector3f> msaa_color_buf;
+        std::vector<int> msaa_sample_slot;
+        std::vector<Eigen::Vector3f> msaa_sample_buf;
+        std::vector<int> msaa_free_slots;
         int get_index(int x, int y);
 
         int width, height;